@@ -0,0 +1,102 @@
+#pragma once
+
+#include "sheap/Sheap.h"
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace sheap {
+// Bump allocation out of whole pages of a Sheap, for objects that die
+// together. Nothing is freed on its own: the pages go back all at once when
+// the arena is rewound, reset or destroyed, without touching the objects.
+// Pages come from the heap of thread slot `tid`, cached ones first, and count
+// towards the tenant's quota. Arena memory must not be passed to
+// Sheap::free(); recover() takes back the pages of every arena. An arena is
+// used by one thread at a time.
+class arena {
+public:
+  // Where an arena stood, see save().
+  struct savepoint {
+    const detail::Page *page = nullptr;
+    std::byte *cur = nullptr;
+    std::byte *end = nullptr;
+  };
+
+  // Rewinds the arena on scope exit, so that scopes nest.
+  class scope {
+  public:
+    explicit scope(arena &a) noexcept : m_arena(a), m_savepoint(a.save()) {}
+    ~scope() { m_arena.rewind(m_savepoint); }
+    scope(const scope &) = delete;
+    scope &operator=(const scope &) = delete;
+
+  private:
+    arena &m_arena;
+    const savepoint m_savepoint;
+  };
+
+  arena(Sheap &sheap, int tid, int tenant = 0) noexcept
+      : m_sheap(&sheap), m_tid(tid), m_tenant(tenant) {}
+  arena(arena &&o) noexcept
+      : m_sheap(o.m_sheap), m_tid(o.m_tid), m_tenant(o.m_tenant),
+        m_pages(std::move(o.m_pages)), m_cur(std::exchange(o.m_cur, nullptr)),
+        m_end(std::exchange(o.m_end, nullptr)) {}
+  arena(const arena &) = delete;
+  arena &operator=(const arena &) = delete;
+  ~arena() { release(); }
+
+  // `align` must be a power of 2. Anything larger than a page gets a run of
+  // pages of its own. Returns nullptr if no pages are left.
+  void *alloc(std::size_t size,
+              std::size_t align = alignof(std::max_align_t)) noexcept {
+    BOOST_ASSERT(detail::is_pow2(align));
+    auto start = boost::alignment::align_up(detail::to_int(m_cur), align);
+    auto end = detail::to_int(m_end);
+
+    if (BOOST_LIKELY(start < end && size <= end - start)) {
+      m_cur = detail::to_ptr<std::byte *>(start + size);
+      detail::asan_unpoison_memory_region(detail::to_ptr(start), size);
+      return detail::to_ptr(start);
+    }
+
+    return alloc_slow(size, align);
+  }
+
+  // Objects are never destroyed, so they must not need to be.
+  template <typename T, typename... Args> T *construct(Args &&... args) {
+    static_assert(std::is_trivially_destructible_v<T>,
+                  "arena objects are never destroyed");
+
+    if (auto mem = alloc(sizeof(T), alignof(T)))
+      return new (mem) T{std::forward<Args>(args)...};
+    return nullptr;
+  }
+
+  [[nodiscard]] savepoint save() const noexcept {
+    return {m_pages.empty() ? nullptr : &m_pages.front(), m_cur, m_end};
+  }
+  // Frees everything allocated since `sp` was saved, which must not have
+  // been rewound past already, and gives back the pages taken since.
+  void rewind(const savepoint &sp) noexcept;
+  // Frees everything, keeping the first page for what comes next.
+  void reset() noexcept;
+  // Frees everything and gives back every page.
+  void release() noexcept { rewind(savepoint{}); }
+
+  // Bytes of the pages held.
+  [[nodiscard]] std::size_t capacity() const noexcept;
+
+private:
+  void *alloc_slow(std::size_t size, std::size_t align) noexcept;
+
+  Sheap *m_sheap;
+  int m_tid;
+  int m_tenant;
+  // Newest first. The free part of the current page is [m_cur, m_end).
+  detail::FreePageList m_pages;
+  std::byte *m_cur = nullptr;
+  std::byte *m_end = nullptr;
+};
+} // namespace sheap
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "sheap/Sheap.h"
+
+#include <cstddef>
+#include <string>
+
+namespace sheap {
+struct segment_options {
+  // Back the segment with an anonymous memfd rather than a shm_open() name;
+  // other processes then attach through the file descriptor.
+  bool memfd = false;
+  // memfd: back it with hugetlbfs pages (MFD_HUGETLB), which must have been
+  // reserved. Otherwise ask for transparent huge pages (MADV_HUGEPAGE).
+  bool huge_pages = false;
+  // Fault every page in while mapping (MAP_POPULATE).
+  bool populate = false;
+  // Keep every page resident (mlock); implies populate.
+  bool lock = false;
+};
+
+// A Sheap in shared memory that maps itself at the same address in every
+// process, as Sheap requires. The first bytes record that address; open()
+// fails with std::system_error(EEXIST) if something else occupies it. All
+// failures throw std::system_error.
+class segment {
+public:
+  static constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+  // With huge pages, the Page array starts on a huge page of its own, so that
+  // descriptor lookups from anywhere in the heap share a few TLB entries.
+  static segment create(const std::string &name, std::size_t size,
+                        const config &c, const segment_options &opts = {});
+  static segment open(const std::string &name,
+                      const segment_options &opts = {});
+  // Attaches to a memfd segment through a descriptor of it, e.g. one
+  // received over a unix socket. The descriptor is duplicated.
+  static segment open(int fd, const segment_options &opts = {});
+  // Removes the name of a shm_open() segment; mappings stay valid.
+  static void remove(const std::string &name) noexcept;
+
+  segment(segment &&o) noexcept;
+  segment(const segment &) = delete;
+  segment &operator=(const segment &) = delete;
+  ~segment();
+
+  [[nodiscard]] Sheap &heap() noexcept { return m_heap; }
+  [[nodiscard]] int fd() const noexcept { return m_fd; }
+  [[nodiscard]] void *base() const noexcept { return m_base; }
+  [[nodiscard]] std::size_t size() const noexcept { return m_size; }
+
+private:
+  segment(int fd, void *base, std::size_t size, Sheap &&heap) noexcept
+      : m_fd(fd), m_base(base), m_size(size), m_heap(std::move(heap)) {}
+
+  static segment attach(int fd, const segment_options &opts);
+
+  int m_fd;
+  void *m_base;
+  std::size_t m_size;
+  Sheap m_heap;
+};
+} // namespace sheap
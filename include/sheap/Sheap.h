@@ -2,38 +2,332 @@
 
 #include "detail/utils.h"
 #include "sheap/detail/SizeClass.h"
+#include "sheap/detail/ThreadCache.h"
 
+#ifdef SHEAP_ENABLE_PROFILER
+#include "sheap/detail/Profiler.h"
+#endif
+
+#include <atomic>
 #include <boost/align/align_up.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string_view>
 #include <thread>
+#include <type_traits>
 #include <utility>
 
 namespace sheap {
 struct config {
   const int max_threads = -1;
-  const std::size_t page_size = 64 * 1024;
+  // Base page size. Each size class uses runs of 2^n base pages as its pages,
+  // see detail::get_page_order().
+  const std::size_t page_size = 8 * 1024;
   const std::size_t num_heaps =
       detail::next_pow_2(std::thread::hardware_concurrency() * 4);
+  // Tenants each get num_heaps heaps and max_threads thread slots of their
+  // own, see Sheap::create_tenant().
+  const int max_tenants = 1;
+  // If nonzero, the Page array starts at a multiple of it (a power of 2),
+  // e.g. a huge page boundary.
+  const std::size_t page_array_align = 0;
+  // Set if the memory given to the heap is all zero, e.g. a fresh mapping,
+  // so that Sheap::calloc() need not clear objects never handed out before.
+  const bool zeroed = false;
 
   explicit config(int max_threads) : max_threads(max_threads) {}
   constexpr config(int max_threads, std::size_t page_size,
-                   std::size_t num_heaps)
-      : max_threads(max_threads), page_size(page_size), num_heaps(num_heaps) {}
+                   std::size_t num_heaps, int max_tenants = 1,
+                   std::size_t page_array_align = 0, bool zeroed = false)
+      : max_threads(max_threads), page_size(page_size), num_heaps(num_heaps),
+        max_tenants(max_tenants), page_array_align(page_array_align),
+        zeroed(zeroed) {}
+};
+
+// Tag for attaching to a heap that an earlier Sheap created in `mem`.
+struct open_existing_t {
+  explicit open_existing_t() = default;
 };
+inline constexpr open_existing_t open_existing{};
+
+// Why Sheap::try_alloc() returned nullptr.
+enum class alloc_error : std::uint8_t {
+  NONE,
+  CONTENDED,  // Some lock was busy; a retry may succeed.
+  OVER_QUOTA, // The tenant holds as many pages as it may.
+  NO_MEMORY,  // No page was left that could be had without reclaiming.
+};
+
+// Occupancy of the pages on the heaps' lists, see Sheap::stats().
+struct heap_stats {
+  std::size_t page_bytes = 0; // Object slots of those pages.
+  std::size_t free_bytes = 0; // Free slots among them.
+  std::size_t num_partial_pages = 0;
+
+  // Share of the slots that is free, yet cannot be given back because it is
+  // scattered over pages still in use.
+  [[nodiscard]] double fragmentation() const noexcept {
+    return page_bytes ? static_cast<double>(free_bytes) / page_bytes : 0;
+  }
+};
+
+// Names an object that Sheap::compact() may move, see Sheap::alloc_handle().
+// handle{} names none.
+enum class handle : std::uint64_t {};
 
 template <bool Value> struct flush_cache {
   static constexpr auto value = Value ? 0x1 : 0;
 };
 
+class arena;
+
 class Sheap {
 public:
   explicit Sheap(void *mem, std::size_t size, const config &c);
-  Sheap(Sheap &&o) : m_imp(std::exchange(o.m_imp, nullptr)) {}
+  // All allocator state lives in `mem` and refers to it by address, so a heap
+  // kept in a file can be reopened as long as it is mapped at the same
+  // address again. Throws std::invalid_argument if `mem` holds no such heap,
+  // and std::runtime_error if 64 Sheaps are attached to it already.
+  Sheap(void *mem, std::size_t size, open_existing_t);
+  Sheap(Sheap &&o)
+      : m_imp(std::exchange(o.m_imp, nullptr)), m_tcache(o.m_tcache),
+        m_thread_mask(o.m_thread_mask), m_user(o.m_user) {
+#ifdef SHEAP_ENABLE_PROFILER
+    m_prof = o.m_prof.exchange(nullptr);
+#endif
+  }
 
   Sheap(const Sheap &) = delete;
+#ifdef SHEAP_ENABLE_PROFILER
+  ~Sheap() { delete m_prof.load(); }
+#endif
+
+  // Only the pop from the thread's active page is inlined into the caller;
+  // anything else goes through the out-of-line slow path.
+  void *alloc(int tid, std::size_t size) noexcept {
+    BOOST_ASSERT(size <= max_alloc_size());
+    auto binid = detail::BinMap[size];
+    auto &tcache = m_tcache[tid & m_thread_mask][binid];
+
+#ifdef SHEAP_ENABLE_PROFILER
+    if (BOOST_UNLIKELY(tcache.sample(size)))
+      return alloc_sampled(tid, size);
+#endif
+
+    if (auto mem = tcache.alloc_fast<false>(); BOOST_LIKELY(mem != nullptr)) {
+      detail::asan_unpoison_memory_region(mem, detail::Bins[binid].size);
+      return mem;
+    }
+
+    return alloc_slow(tid, size);
+  }
+  // Like alloc(), but the object is zeroed. Objects the active page carves
+  // off memory never used since the heap was created are not written if the
+  // heap was given zeroed memory, see config::zeroed.
+  void *calloc(int tid, std::size_t size) noexcept {
+    BOOST_ASSERT(size <= max_alloc_size());
+    auto binid = detail::BinMap[size];
+    auto &tcache = m_tcache[tid & m_thread_mask][binid];
+    auto clear = [size](void *mem) {
+      return mem != nullptr ? std::memset(mem, 0, size) : nullptr;
+    };
+
+#ifdef SHEAP_ENABLE_PROFILER
+    if (BOOST_UNLIKELY(tcache.sample(size)))
+      return clear(alloc_sampled(tid, size));
+#endif
+
+    auto zeroed = tcache.is_next_zeroed();
+    if (auto mem = tcache.alloc_fast<false>(); BOOST_LIKELY(mem != nullptr)) {
+      detail::asan_unpoison_memory_region(mem, detail::Bins[binid].size);
+      return zeroed ? mem : clear(mem);
+    }
 
-  void *alloc(int tid, std::size_t size) noexcept;
+    return clear(alloc_slow(tid, size));
+  }
   void *aligned_alloc(int tid, std::size_t size, std::size_t align) noexcept;
+  // Like alloc(), but never waits for a lock and runs in bounded time, e.g.
+  // for signal handlers and real-time threads: objects come from the thread
+  // cache, a transfer batch, partial or cached pages of the thread's heap, or
+  // one fresh page, each taken only if its lock is free. Pending remote frees
+  // are not applied and other heaps are not searched. On failure returns
+  // nullptr and, if `error` is given, stores the reason there. A signal
+  // handler needs a thread slot of its own. Not sampled by the profiler.
+  void *try_alloc(int tid, std::size_t size,
+                  alloc_error *error = nullptr) noexcept;
+  // Like alloc(), but if the heap is out of memory, waits up to `timeout` for
+  // pages to be freed rather than fail, so that producers are held back
+  // until consumers catch up. Waiters, in any process using the heap, are
+  // served in the order they came. Frees of pages wake them; frees of single
+  // objects are noticed within WaitQueue::HEAD_POLL. Returns nullptr once the
+  // timeout has passed, or at once if WaitQueue::MAX_WAITERS are waiting
+  // already.
+  void *alloc_wait(int tid, std::size_t size,
+                   std::chrono::nanoseconds timeout =
+                       std::chrono::nanoseconds::max()) noexcept;
+  // Like alloc(), but puts the object close to `hint`, an object of this heap
+  // it will be used with, to save cache and TLB misses when going from one
+  // to the other: on the page of `hint` if that has room and is on its
+  // heap's lists, else on the page with room closest to it among those the
+  // thread holds. Objects of different size classes never share a page, and
+  // a group is kept together by hinting with any of its members. Objects
+  // placed by hint are not sampled by the profiler.
+  void *alloc_near(int tid, std::size_t size, const void *hint) noexcept;
+  // Allocates from the pages of `tenant`; alloc(tid, size) is tenant 0.
+  void *alloc(int tenant, int tid, std::size_t size) noexcept;
   void free(void *ptr) noexcept;
+  // Like free(), but keeps the object in the cache of thread slot `tid` for
+  // its next allocations, passing surplus objects on to other threads in
+  // batches. Only the thread using `tid` may call it.
+  void free(int tid, void *ptr) noexcept;
+  // Returns the objects kept by free(tid, ptr), and the pages the thread
+  // allocates from, to their heaps, e.g. when the thread exits.
+  void flush_thread_cache(int tid) noexcept;
+  // Fills the cache of thread slot `tid` with pages for objects of `size`
+  // bytes, faulted in, until `count` of them can be allocated without taking
+  // a lock, e.g. before a latency critical phase. Returns how many can, fewer
+  // than `count` if the heap ran out of pages. Only the thread using `tid`
+  // may call it; collect_garbage() may give the pages back.
+  std::size_t reserve(int tid, std::size_t size, std::size_t count) noexcept;
+  // How many objects of `size` bytes thread slot `tid` can allocate without
+  // taking a lock.
+  [[nodiscard]] std::size_t available(int tid,
+                                      std::size_t size) const noexcept;
+  // `ptr` must come from alloc() of `size` bytes. The bin is taken from the
+  // size rather than looked up from the page.
+  void free_sized(void *ptr, std::size_t size) noexcept {
+    BOOST_ASSERT(size <= max_alloc_size());
+    free_in_bin(ptr, detail::BinMap[size]);
+  }
+
+  // Epoch-based reclamation for lock-free structures kept in the heap.
+  // Readers bracket each access with epoch_enter(tid) and epoch_exit(tid),
+  // which nest, or hold an epoch_guard. An object unlinked from a structure
+  // is passed to retire(tid, ptr) instead of free(); it is freed once every
+  // slot pinned at the time has left. Retired objects are kept per thread
+  // slot and released in batches through free(). A slot whose process died
+  // while pinned does not hold back the others; recover() frees everything
+  // retired. Only the thread using `tid` may call these.
+  void epoch_enter(int tid) noexcept;
+  void epoch_exit(int tid) noexcept;
+  void retire(int tid, void *ptr) noexcept;
+  // Advances the epoch if it can and frees what slot `tid` retired long
+  // enough ago, e.g. when it stops retiring for a while.
+  void epoch_collect(int tid) noexcept;
+
+  // Relocatable objects, for long-lived data that would otherwise keep
+  // sparse pages alive. An object is named by a handle, looked up in a table
+  // in the heap, and may only be accessed while pinned through pin(h) and
+  // unpin(h), which nest, or a pinned<T> guard. Pinning waits while the
+  // object is being moved. alloc_handle() returns handle{} if out of memory.
+  // Objects are moved with memcpy, so must be trivially copyable, and are
+  // freed with free_handle(), which waits until nobody holds them pinned.
+  [[nodiscard]] handle alloc_handle(int tid, std::size_t size) noexcept;
+  void free_handle(handle h) noexcept;
+  [[nodiscard]] void *pin(handle h) noexcept;
+  void unpin(handle h) noexcept;
+  // Moves the unpinned objects of handles off the partial pages of tenant 0
+  // with at most `max_occupancy` of their objects in use, into pages
+  // allocated for thread slot `tid`. Pages left empty go back to the heap.
+  // May run alongside everything else, e.g. in a background thread; objects
+  // allocated through alloc() stay where they are. Returns how many objects
+  // were moved.
+  std::size_t compact(int tid, double max_occupancy = 0.25);
+
+  // Tenants partition the heap: each has its own heaps and caches and may be
+  // limited in the pages it holds. Past a hard quota its allocations fail;
+  // past a soft one they only succeed once the tenant has reclaimed what it
+  // can. Tenant 0 always exists. create_tenant() returns -1 if the name is
+  // taken or longer than 31 characters, or all config::max_tenants exist.
+  [[nodiscard]] int create_tenant(const char *name,
+                                  std::size_t quota = SIZE_MAX,
+                                  bool hard = true) noexcept;
+  [[nodiscard]] int find_tenant(const char *name) const noexcept;
+  void set_quota(int tenant, std::size_t quota, bool hard = true) noexcept;
+  // Bytes of pages held by the tenant, in use or cached.
+  [[nodiscard]] std::size_t tenant_usage(int tenant) const noexcept;
+
+  // True if some earlier user of the heap did not close() it, because its
+  // process died, and every other user attached is in a process that died
+  // too. Processes are told apart by pid, where the platform has them.
+  [[nodiscard]] bool needs_recovery() const noexcept;
+  // Rebuilds the allocator state from the page descriptors, in time linear in
+  // the number of pages. Pages held by thread caches are returned to their
+  // heaps and every lock is released, so nobody else may be attached.
+  // Objects that were being allocated or freed at the time of the crash may
+  // leak; none is handed out twice.
+  void recover() noexcept;
+  // Detaches from the heap; this handle may not be used afterwards.
+  void close() noexcept;
+  // Around fork() in a process whose other threads may be using the heap,
+  // e.g. from pthread_atfork() handlers: takes every lock of the heap, so
+  // that the child inherits none held by a thread it does not have, and
+  // releases them again in the parent and in the child.
+  void lock_for_fork() noexcept;
+  void unlock_after_fork() noexcept;
+
+  // A pointer stored in the heap itself, to find the application's data
+  // again after reopening it.
+  void set_root(void *ptr) noexcept;
+  [[nodiscard]] void *get_root() const noexcept;
+
+  // Grows the heap by [mem, mem + size), which every process using the heap
+  // must map at the same address. Memory is looked up in 16 MiB granules, so
+  // the ends of the region that share a granule with another region go
+  // unused. Fails if RegionMap::MAX_REGIONS regions exist or the address
+  // space they span outgrows the lookup tables.
+  bool add_region(void *mem, std::size_t size) noexcept;
+  // Removes every added region none of whose pages is in use, then calls
+  // fn(mem, size) with each, e.g. to unmap it. Empty pages cached by the
+  // heaps are given back first; those held by thread caches keep their
+  // region. Returns how many regions were removed.
+  template <typename Fn> std::size_t release_empty_regions(Fn &&fn) {
+    return release_empty_regions_impl(
+        [](void *arg, void *mem, std::size_t size) {
+          (*static_cast<std::remove_reference_t<Fn> *>(arg))(mem, size);
+        },
+        &fn);
+  }
+
+  // Whether `ptr` lies in the memory handed out by this heap.
+  [[nodiscard]] bool contains(const void *ptr) const noexcept;
+  // Bytes usable at `ptr`, which must have been returned by this heap.
+  [[nodiscard]] std::size_t usable_size(const void *ptr) const noexcept;
+
+#ifdef SHEAP_ENABLE_PROFILER
+  // Samples about one allocation per `sample_period` bytes allocated through
+  // alloc(). Takes effect on each thread within about a MiB of allocation.
+  // Does nothing if the profiler cannot be allocated.
+  void start_profiling(std::size_t sample_period = 512 * 1024) noexcept;
+  void stop_profiling() noexcept;
+  // Writes a pprof heap profile of the sampled objects still live in this
+  // process, along with the allocation counts of every call stack.
+  void dump_heap_profile(std::ostream &os) const;
+  // Attributes the calling thread's samples to `tag` rather than its stack,
+  // which is cheaper and survives stripped binaries; nullptr undoes it.
+  static void set_profile_tag(const void *tag) noexcept {
+    detail::Profiler::set_tag(tag);
+  }
+#endif
+
+  // Calls fn(ptr, size) for every live object, with `ptr` and `size` its slot;
+  // for aligned_alloc() the object lies somewhere inside. Unless `stopped`
+  // promises that no thread is using the heap, the walk runs alongside
+  // allocation: objects allocated or freed while it runs may or may not be
+  // reported. fn() is called with no lock held and may use the heap.
+  template <typename Fn> void walk(Fn &&fn, bool stopped = false) {
+    walk_impl(
+        [](void *arg, void *ptr, std::size_t size) {
+          (*static_cast<std::remove_reference_t<Fn> *>(arg))(ptr, size);
+        },
+        &fn, stopped);
+  }
+
+  // Takes each bin's lock in turn, applying its pending frees. Pages held by
+  // thread caches are not counted.
+  [[nodiscard]] heap_stats stats() noexcept;
 
   template <typename FlushCache = flush_cache<false>>
   void collect_garbage(int tid = -1) noexcept {
@@ -60,23 +354,181 @@ public:
     return nullptr;
   }
 
+  // Named objects, for the processes attached to a heap to find each other's
+  // data. Lookups take no lock. There is room for Directory::NUM_ENTRIES
+  // names of fewer than 32 characters. An object is only found with a type of
+  // the size and alignment it was made with; otherwise, or if it could not be
+  // made, these return nullptr.
+  template <typename T, typename... Args>
+  T *find_or_construct(int tid, std::string_view name, Args &&... args) {
+    auto make = [&]() -> void * {
+      return construct<T>(tid, std::forward<Args>(args)...);
+    };
+
+    return static_cast<T *>(find_or_construct_impl(
+        name, type_tag<T>(),
+        [](void *arg) { return (*static_cast<decltype(make) *>(arg))(); },
+        &make));
+  }
+  template <typename T>
+  [[nodiscard]] T *find(std::string_view name) const noexcept {
+    return static_cast<T *>(find_impl(name, type_tag<T>()));
+  }
+
   template <typename T> void destruct(T *ptr) noexcept {
     static_assert(alignof(T) <= max_alloc_size());
+
+    constexpr auto binid = detail::BinMap[sizeof(T)];
     ptr->~T();
-    free(static_cast<void *>(ptr));
+    if constexpr (detail::Bins[binid].alignment == alignof(T)) {
+      free_in_bin(static_cast<void *>(ptr), binid);
+    } else {
+      free(static_cast<void *>(ptr));
+    }
   }
 
   static constexpr std::size_t max_alloc_size() { return detail::MaxAllocSize; }
 
 private:
+  friend class arena;
   struct impl;
 
   template <bool IsAlignedAlloc>
-  void *alloc(int tid, std::size_t size) noexcept;
+  void *alloc(int tenant, int tid, std::size_t size) noexcept;
+  void *alloc_slow(int tid, std::size_t size) noexcept;
+#ifdef SHEAP_ENABLE_PROFILER
+  void *alloc_sampled(int tid, std::size_t size) noexcept;
+#endif
   static impl *create(void *mem, std::size_t size, const config &c);
+  static impl *open(void *mem, std::size_t size);
+  void free_in_bin(void *ptr, int binid) noexcept;
   void collect_garbage(int tid, bool flush_cache) noexcept;
+  void walk_impl(void (*fn)(void *, void *, std::size_t), void *arg,
+                 bool stopped);
+  void *find_or_construct_impl(std::string_view name, std::uint64_t type,
+                               void *(*make)(void *), void *arg);
+  void *find_impl(std::string_view name, std::uint64_t type) const noexcept;
+  // With the tenant lock held, so that a name can be checked and claimed at
+  // once.
+  [[nodiscard]] int find_tenant_locked(const char *name) const noexcept;
+  std::size_t
+  release_empty_regions_impl(void (*fn)(void *, void *, std::size_t),
+                             void *arg);
+  // Runs of 2^order base pages for arenas, from the heap of thread slot `tid`
+  // of `tenant`, and back.
+  detail::Page *alloc_arena_page(int tenant, int tid, int order) noexcept;
+  void free_arena_pages(int tenant, int tid,
+                        detail::FreePageList &pages) noexcept;
+  [[nodiscard]] void *get_page_ptr(const detail::Page *page) const noexcept;
+  [[nodiscard]] std::size_t get_page_size() const noexcept;
+
+  template <typename T> static constexpr std::uint64_t type_tag() {
+    return std::uint64_t{sizeof(T)} << 16 | alignof(T);
+  }
 
   impl *m_imp;
+  // Copies of the thread cache table from m_imp, for the inline fast path.
+  detail::ThreadCache *const *m_tcache;
+  int m_thread_mask;
+  // This handle's slot among the heap's users.
+  int m_user;
+#ifdef SHEAP_ENABLE_PROFILER
+  // Made by the first start_profiling() rather than up front, as the malloc
+  // shim builds its heap before malloc can be called.
+  std::atomic<detail::Profiler *> m_prof = nullptr;
+#endif
+};
+
+// Allocator handle for objects of one type, bound to a thread slot. The bin
+// is resolved at compile time, so frees skip the size class lookup. Single
+// objects use the sized path; arrays fall back to Sheap::alloc/free.
+template <typename T> class pool {
+public:
+  using value_type = T;
+
+  pool(Sheap &sheap, int tid) noexcept : m_sheap(&sheap), m_tid(tid) {}
+  template <typename U>
+  pool(const pool<U> &o) noexcept : m_sheap(o.m_sheap), m_tid(o.m_tid) {}
+
+  T *allocate(std::size_t n = 1) {
+    void *mem = nullptr;
+
+    if (n == 1) {
+      static_assert(sizeof(T) <= Sheap::max_alloc_size(),
+                    "cannot allocate more than max_alloc_size()");
+      static_assert(alignof(T) <=
+                        detail::Bins[detail::BinMap[sizeof(T)]].alignment,
+                    "over-aligned types are not supported");
+      mem = m_sheap->alloc(m_tid, sizeof(T));
+    } else if (n <= Sheap::max_alloc_size() / sizeof(T)) {
+      mem = m_sheap->alloc(m_tid, n * sizeof(T));
+    }
+
+    if (mem == nullptr)
+      throw std::bad_alloc{};
+
+    return static_cast<T *>(mem);
+  }
+
+  void deallocate(T *ptr, std::size_t n = 1) noexcept {
+    if (n == 1) {
+      m_sheap->free_sized(static_cast<void *>(ptr), sizeof(T));
+    } else {
+      m_sheap->free(static_cast<void *>(ptr));
+    }
+  }
+
+  template <typename... Args> T *new_object(Args &&... args) {
+    return m_sheap->construct<T>(m_tid, std::forward<Args>(args)...);
+  }
+  void delete_object(T *ptr) noexcept { m_sheap->destruct(ptr); }
+
+  template <typename U> bool operator==(const pool<U> &o) const noexcept {
+    return m_sheap == o.m_sheap;
+  }
+  template <typename U> bool operator!=(const pool<U> &o) const noexcept {
+    return !(*this == o);
+  }
+
+private:
+  template <typename U> friend class pool;
+
+  Sheap *m_sheap;
+  int m_tid;
+};
+
+// Keeps thread slot `tid` pinned while it lives, see Sheap::epoch_enter().
+class epoch_guard {
+public:
+  epoch_guard(Sheap &sheap, int tid) noexcept : m_sheap(sheap), m_tid(tid) {
+    sheap.epoch_enter(tid);
+  }
+  ~epoch_guard() { m_sheap.epoch_exit(m_tid); }
+  epoch_guard(const epoch_guard &) = delete;
+  epoch_guard &operator=(const epoch_guard &) = delete;
+
+private:
+  Sheap &m_sheap;
+  int m_tid;
+};
+
+// Keeps the object of a handle pinned while it lives, see Sheap::pin().
+template <typename T> class pinned {
+public:
+  pinned(Sheap &sheap, handle h) noexcept
+      : m_sheap(sheap), m_handle(h), m_ptr(static_cast<T *>(sheap.pin(h))) {}
+  ~pinned() { m_sheap.unpin(m_handle); }
+  pinned(const pinned &) = delete;
+  pinned &operator=(const pinned &) = delete;
+
+  [[nodiscard]] T *get() const noexcept { return m_ptr; }
+  T &operator*() const noexcept { return *m_ptr; }
+  T *operator->() const noexcept { return m_ptr; }
+
+private:
+  Sheap &m_sheap;
+  handle m_handle;
+  T *m_ptr;
 };
 
 } // namespace sheap
\ No newline at end of file
@@ -1,10 +1,12 @@
 #pragma once
 
 #include "Page.h"
+#include "RegionMap.h"
 #include "utils.h"
 
 #include <atomic>
 #include <cstddef>
+#include <tuple>
 
 namespace sheap::detail {
 class object {
@@ -30,6 +32,10 @@ public:
 
     return n;
   }
+  // For a reader racing the owner of the list, who checks afterwards.
+  inline object *racy_next() const {
+    return racy_load(reinterpret_cast<object *const *>(&next));
+  }
 
 private:
   std::atomic<object *> next;
@@ -39,31 +45,55 @@ class Context {
 public:
   Context(Page *pages, std::size_t num_pages, std::size_t page_size, void *base)
       : m_sizeclasses(create_sizeclasses(page_size)), m_pages(pages),
-        m_page_size(page_size), m_log_page_size(log2(page_size)), m_base(base)
-#ifndef BOOST_ASSERT_IS_VOID
-        ,
-        m_num_pages(num_pages)
-#endif
-  {
+        m_page_size(page_size), m_log_page_size(log2(page_size)), m_base(base),
+        m_num_pages(num_pages) {
     asan_poison_memory_region(pages, sizeof(Page) * num_pages);
     asan_poison_memory_region(base, page_size * num_pages);
   }
 
+  // Pages of added regions are found through m_regions, after the check for
+  // the heap's own pages has failed.
   void *get_page_ptr(const Page *page) const noexcept {
     auto pageno = get_pageno(page);
 
-    BOOST_ASSERT(pageno < m_num_pages);
-    return static_cast<void *>(static_cast<std::byte *>(m_base) +
-                               pageno * m_page_size);
+    if (BOOST_LIKELY(pageno < m_num_pages)) {
+      return static_cast<void *>(static_cast<std::byte *>(m_base) +
+                                 pageno * m_page_size);
+    }
+
+    auto region = m_regions.find(page);
+    BOOST_ASSERT(region != nullptr && region->has_page(page));
+    return region->m_base + (page - region->m_pages) * m_page_size;
+  }
+
+  [[nodiscard]] std::size_t get_page_size() const noexcept {
+    return m_page_size;
+  }
+
+  [[nodiscard]] bool contains(const void *ptr) const noexcept {
+    if (to_int(ptr) - to_int(m_base) < m_num_pages * m_page_size)
+      return true;
+
+    auto region = m_regions.find(ptr);
+    return region != nullptr && to_int(ptr) - to_int(region->m_base) <
+                                    region->m_num_pages * m_page_size;
   }
 
   template <typename Ptr> Page *get_page(Ptr obj) const noexcept {
     auto pageno = get_pageno(obj);
 
-    BOOST_ASSERT(pageno < m_num_pages);
-    return m_pages + pageno;
+    if (BOOST_LIKELY(pageno < m_num_pages))
+      return m_pages[pageno].get_span_head();
+
+    auto region = m_regions.find(obj);
+    BOOST_ASSERT(region != nullptr);
+    pageno = (to_int(obj) - to_int(region->m_base)) >> m_log_page_size;
+    BOOST_ASSERT(pageno < region->m_num_pages);
+    return region->m_pages[pageno].get_span_head();
   }
 
+  [[nodiscard]] RegionMap &get_regions() noexcept { return m_regions; }
+
   inline auto get_alloc_info(void *ptr) const noexcept
       -> std::tuple<void *, Page *, const SizeClass &> {
     auto page = get_page(ptr);
@@ -90,6 +120,7 @@ private:
 
     for (int i = 0; i < static_cast<int>(NUM_BINS); i++) {
       sizeclasses[i] = {i, Bins[i], page_size};
+      BOOST_ASSERT(sizeclasses[i].num_objs > 0);
     }
 
     return sizeclasses;
@@ -109,8 +140,7 @@ private:
   const std::size_t m_page_size;
   const int m_log_page_size;
   void *m_base;
-#ifndef BOOST_ASSERT_IS_VOID
   const std::size_t m_num_pages;
-#endif
+  RegionMap m_regions = {};
 };
 } // namespace sheap::detail
\ No newline at end of file
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "utils.h"
+
+#include <atomic>
+#include <boost/interprocess/sync/spin/wait.hpp>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace sheap::detail {
+// Fixed table of named objects, probed linearly from the hash of the name.
+// An entry is claimed by a CAS on its key, which holds the hash, so lookups
+// never wait on entries of other names; only a lookup racing with the
+// insertion of its own name (or of a colliding one) spins until the name is
+// written.
+class Directory {
+public:
+  static constexpr int NUM_ENTRIES = 256;
+  static constexpr std::size_t MAX_NAME = 32;
+
+  [[nodiscard]] void *find(std::string_view name,
+                           std::uint64_t type) const noexcept {
+    if (name.size() >= MAX_NAME)
+      return nullptr;
+
+    auto key = hash(name);
+    for (int i = 0; i < NUM_ENTRIES; i++) {
+      auto &e = m_entries[(key + i) % NUM_ENTRIES];
+      auto ekey = e.m_key.load(std::memory_order_acquire);
+
+      if (ekey == 0)
+        return nullptr;
+
+      if (ekey == key && e.wait_named() && name == e.m_name)
+        return e.get(type);
+    }
+
+    return nullptr;
+  }
+
+  // Returns the object called `name`, made by make() if there is none yet.
+  // make() returns nullptr or throws on failure; the entry is then given up.
+  template <typename Make>
+  void *find_or_insert(std::string_view name, std::uint64_t type,
+                       Make &&make) {
+    if (name.size() >= MAX_NAME)
+      return nullptr;
+
+    auto key = hash(name);
+    for (int i = 0; i < NUM_ENTRIES; i++) {
+      auto &e = m_entries[(key + i) % NUM_ENTRIES];
+      auto ekey = e.m_key.load(std::memory_order_acquire);
+
+      if (ekey == 0) {
+        if (e.m_key.compare_exchange_strong(ekey, key))
+          return e.insert(name, type, make);
+      }
+
+      if (ekey == key && e.wait_named() && name == e.m_name) {
+        e.wait_ready();
+        return e.get(type);
+      }
+    }
+
+    return nullptr;
+  }
+
+  // Recovery: entries left half made by a dead process are given up.
+  void reset() noexcept {
+    for (auto &e : m_entries) {
+      if (e.m_key != 0 && e.m_state != READY)
+        e.m_state = DEAD;
+    }
+  }
+
+private:
+  enum : std::uint8_t { CLAIMED, NAMED, READY, DEAD };
+
+  struct alignas(CACHELINE_SIZE) entry {
+    std::atomic<std::uint64_t> m_key = 0;
+    std::atomic<std::uint8_t> m_state = CLAIMED;
+    std::uint64_t m_type = 0;
+    void *m_ptr = nullptr;
+    char m_name[MAX_NAME] = {};
+
+    template <typename Make>
+    void *insert(std::string_view name, std::uint64_t type, Make &&make) {
+      name.copy(m_name, name.size());
+      m_type = type;
+      m_state.store(NAMED, std::memory_order_release);
+
+      try {
+        m_ptr = make();
+      } catch (...) {
+        m_state.store(DEAD, std::memory_order_release);
+        throw;
+      }
+
+      m_state.store(m_ptr ? READY : DEAD, std::memory_order_release);
+      return m_ptr;
+    }
+
+    // Whether the name can be read: false if the entry was given up.
+    bool wait_named() const noexcept {
+      return wait_for([](auto state) { return state != CLAIMED; });
+    }
+    bool wait_ready() const noexcept {
+      return wait_for([](auto state) { return state >= READY; });
+    }
+
+    template <typename Pred> bool wait_for(Pred &&pred) const noexcept {
+      boost::interprocess::spin_wait swait;
+      auto state = m_state.load(std::memory_order_acquire);
+
+      while (!pred(state)) {
+        swait.yield();
+        state = m_state.load(std::memory_order_acquire);
+      }
+
+      return state != DEAD;
+    }
+
+    void *get(std::uint64_t type) const noexcept {
+      if (m_state.load(std::memory_order_acquire) != READY || m_type != type)
+        return nullptr;
+      return m_ptr;
+    }
+  };
+
+  static_assert(sizeof(entry) == CACHELINE_SIZE);
+
+  // FNV-1a, never 0 as that marks a free entry.
+  static std::uint64_t hash(std::string_view name) noexcept {
+    std::uint64_t h = 0xcbf29ce484222325;
+    for (auto c : name)
+      h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+    return h ? h : 1;
+  }
+
+  entry m_entries[NUM_ENTRIES];
+};
+} // namespace sheap::detail
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "Context.h"
+#include "Process.h"
+#include "utils.h"
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+namespace sheap::detail {
+// What one thread slot contributes to epoch-based reclamation. The state is
+// read by everyone advancing the epoch; the rest only by the slot's owner.
+struct alignas(CACHELINE_SIZE) EpochRecord {
+  static constexpr int NUM_LIMBO = 3;
+
+  // The epoch the slot is pinned in, shifted left by one, with the low bit
+  // set while it is pinned.
+  std::atomic<std::uint64_t> m_state = 0;
+  // The process that pinned it, to tell whether it is still there.
+  std::atomic<int> m_pid = 0;
+  // Nested pins, only meaningful while this process holds the slot pinned.
+  int m_nest = 0;
+
+  // Retired objects, by the epoch they were retired in modulo NUM_LIMBO.
+  alignas(CACHELINE_SIZE) object *m_limbo[NUM_LIMBO] = {};
+  std::uint64_t m_limbo_epoch[NUM_LIMBO] = {};
+  unsigned m_num_retired = 0;
+};
+
+// Epoch-based reclamation. The global epoch only moves from e to e + 1 once
+// every pinned slot has been seen in e, so an object retired in e is out of
+// reach of every reader once the epoch reaches e + 2. A slot pinned by a
+// process that no longer exists is unpinned by whoever finds it in the way.
+class alignas(CACHELINE_SIZE) EpochManager {
+public:
+  // Retirements between attempts to advance the epoch.
+  static constexpr unsigned BATCH_SIZE = 64;
+
+  EpochManager(EpochRecord *records, int num_records) noexcept
+      : m_records(records), m_num_records(num_records) {}
+
+  void enter(int slot) noexcept {
+    auto &rec = m_records[slot];
+    auto pid = current_pid();
+
+    // A pin left behind by a dead process, whether or not it was cleared
+    // yet, is not nested into.
+    if ((rec.m_state.load(std::memory_order_relaxed) & 1) &&
+        rec.m_pid.load(std::memory_order_relaxed) == pid) {
+      rec.m_nest++;
+      return;
+    }
+
+    rec.m_nest = 1;
+    rec.m_pid.store(pid, std::memory_order_relaxed);
+    auto epoch = m_epoch.load(std::memory_order_relaxed);
+    rec.m_state.store(epoch << 1 | 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  void exit(int slot) noexcept {
+    auto &rec = m_records[slot];
+    BOOST_ASSERT(rec.m_nest > 0);
+    if (--rec.m_nest == 0)
+      rec.m_state.store(0, std::memory_order_release);
+  }
+
+  // Calls free(obj) for objects retired long enough ago.
+  template <typename Free>
+  void retire(int slot, object *obj, Free &&free) noexcept {
+    auto &rec = m_records[slot];
+    auto epoch = m_epoch.load(std::memory_order_seq_cst);
+    auto idx = epoch % EpochRecord::NUM_LIMBO;
+
+    // Whatever the list holds was retired NUM_LIMBO epochs ago or earlier.
+    if (rec.m_limbo_epoch[idx] != epoch) {
+      free_all(rec.m_limbo[idx], free);
+      rec.m_limbo_epoch[idx] = epoch;
+    }
+
+    obj->set_next(rec.m_limbo[idx]);
+    rec.m_limbo[idx] = obj;
+
+    if (++rec.m_num_retired % BATCH_SIZE == 0)
+      collect(slot, free);
+  }
+
+  template <typename Free> void collect(int slot, Free &&free) noexcept {
+    try_advance();
+
+    auto &rec = m_records[slot];
+    auto epoch = m_epoch.load(std::memory_order_acquire);
+    for (int i = 0; i < EpochRecord::NUM_LIMBO; i++) {
+      if (rec.m_limbo_epoch[i] + 2 <= epoch)
+        free_all(rec.m_limbo[i], free);
+    }
+  }
+
+  // Recovery: nobody is pinned any more, so everything retired is freed.
+  template <typename Free> void recover(Free &&free) noexcept {
+    for (int i = 0; i < m_num_records; i++) {
+      auto &rec = m_records[i];
+
+      for (auto &limbo : rec.m_limbo)
+        free_all(limbo, free);
+      rec.m_state = 0;
+      rec.m_nest = 0;
+    }
+  }
+
+private:
+  bool try_advance() noexcept {
+    auto epoch = m_epoch.load(std::memory_order_seq_cst);
+
+    for (int i = 0; i < m_num_records; i++) {
+      auto &rec = m_records[i];
+      auto state = rec.m_state.load(std::memory_order_seq_cst);
+
+      if ((state & 1) && state >> 1 != epoch) {
+        if (is_alive(rec.m_pid.load(std::memory_order_relaxed)))
+          return false;
+        rec.m_state.compare_exchange_strong(state, 0);
+      }
+    }
+
+    return m_epoch.compare_exchange_strong(epoch, epoch + 1);
+  }
+
+  template <typename Free>
+  static void free_all(object *&list, Free &&free) noexcept {
+    for (auto obj = std::exchange(list, nullptr); obj;) {
+      auto next = obj->get_next();
+      free(static_cast<void *>(obj));
+      obj = next;
+    }
+  }
+
+  // Starts past the limbo epochs, which are 0 while their lists are empty.
+  std::atomic<std::uint64_t> m_epoch = EpochRecord::NUM_LIMBO;
+  EpochRecord *const m_records;
+  const int m_num_records;
+};
+} // namespace sheap::detail
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "SizeClass.h"
+#include "SpinLock.h"
+#include "utils.h"
+
+#include <atomic>
+#include <boost/assert.hpp>
+#include <boost/interprocess/sync/spin/wait.hpp>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+namespace sheap::detail {
+// Maps handles to the current address of their objects, so that objects can
+// be moved, see Sheap::compact(). A handle is the index of its entry plus one
+// in the low half and the entry's generation in the high half, so that 0 is
+// never a handle. Entries are kept in chunks the size of the largest
+// allocation, allocated from the heap as the table grows.
+class HandleTable {
+public:
+  struct Entry {
+    // A free entry holds the index of the next free one, shifted left and
+    // with the low bit set, which no object address has.
+    std::atomic<std::uintptr_t> m_ptr = 0;
+    // Pins, or MOVING while the object is moved or freed.
+    std::atomic<std::uint32_t> m_state = 0;
+    std::uint32_t m_generation = 0;
+
+    [[nodiscard]] void *get() const noexcept {
+      auto ptr = m_ptr.load(std::memory_order_acquire);
+      return ptr & 1 ? nullptr : to_ptr(ptr);
+    }
+    // With the entry locked.
+    void set(void *ptr) noexcept {
+      m_ptr.store(to_int(ptr), std::memory_order_release);
+    }
+  };
+
+  static constexpr std::uint32_t CHUNK_SIZE = MaxAllocSize / sizeof(Entry);
+  static constexpr std::uint32_t MAX_CHUNKS = 4096;
+  static constexpr std::uint32_t MOVING = 0x80000000;
+
+  // Returns 0 if the table is full or alloc_chunk() returns nullptr.
+  template <typename AllocChunk>
+  std::uint64_t insert(void *ptr, AllocChunk &&alloc_chunk) noexcept {
+    std::lock_guard lock{m_mtx};
+    std::uint32_t idx;
+
+    if (m_free != 0) {
+      idx = m_free - 1;
+      m_free = static_cast<std::uint32_t>(get(idx).m_ptr.load() >> 1);
+    } else {
+      idx = m_size.load(std::memory_order_relaxed);
+      if (idx % CHUNK_SIZE == 0 && !add_chunk(idx / CHUNK_SIZE, alloc_chunk))
+        return 0;
+      m_size.store(idx + 1, std::memory_order_release);
+    }
+
+    auto &e = get(idx);
+    e.set(ptr);
+    return std::uint64_t{e.m_generation} << 32 | (idx + 1);
+  }
+
+  // The entry of `handle`, which must not have been erased.
+  [[nodiscard]] Entry &find(std::uint64_t handle) const noexcept {
+    auto &e = get(static_cast<std::uint32_t>(handle) - 1);
+    BOOST_ASSERT(e.m_generation == handle >> 32);
+    BOOST_ASSERT(e.get() != nullptr);
+    return e;
+  }
+
+  // With the entry locked.
+  void erase(std::uint64_t handle) noexcept {
+    auto idx = static_cast<std::uint32_t>(handle) - 1;
+    auto &e = get(idx);
+    std::lock_guard lock{m_mtx};
+
+    e.m_ptr.store(std::uintptr_t{m_free} << 1 | 1, std::memory_order_release);
+    e.m_generation++;
+    e.m_state.store(0, std::memory_order_release);
+    m_free = idx + 1;
+  }
+
+  [[nodiscard]] static void *pin(Entry &e) noexcept {
+    boost::interprocess::spin_wait swait;
+    while (true) {
+      auto state = e.m_state.load(std::memory_order_relaxed);
+      if (!(state & MOVING) && e.m_state.compare_exchange_weak(
+                                   state, state + 1, std::memory_order_acquire))
+        return e.get();
+      swait.yield();
+    }
+  }
+  static void unpin(Entry &e) noexcept {
+    BOOST_ASSERT((e.m_state.load() & ~MOVING) != 0);
+    e.m_state.fetch_sub(1, std::memory_order_release);
+  }
+
+  // Locking an entry waits for its pins to be released and keeps new ones
+  // out, so that the object can be moved.
+  [[nodiscard]] static bool try_lock(Entry &e) noexcept {
+    std::uint32_t unpinned = 0;
+    return e.m_state.compare_exchange_strong(unpinned, MOVING,
+                                             std::memory_order_acquire);
+  }
+  static void lock(Entry &e) noexcept {
+    boost::interprocess::spin_wait swait;
+    while (!try_lock(e))
+      swait.yield();
+  }
+  static void unlock(Entry &e) noexcept {
+    e.m_state.store(0, std::memory_order_release);
+  }
+
+  // Visits the entries of live handles.
+  template <typename Fn> void for_each(Fn &&fn) noexcept {
+    auto size = m_size.load(std::memory_order_acquire);
+    for (std::uint32_t i = 0; i < size; i++) {
+      if (auto &e = get(i); e.get() != nullptr)
+        fn(e);
+    }
+  }
+
+  // Recovery: every pin and lock is dropped. An object that was being moved
+  // stays where its entry says.
+  void reset() noexcept {
+    m_mtx.reset();
+    for (std::uint32_t i = 0; i < m_size; i++)
+      get(i).m_state = 0;
+  }
+  // For Sheap::lock_for_fork().
+  [[nodiscard]] SpinLock &get_lock() noexcept { return m_mtx; }
+
+private:
+  [[nodiscard]] Entry &get(std::uint32_t idx) const noexcept {
+    return m_chunks[idx / CHUNK_SIZE][idx % CHUNK_SIZE];
+  }
+
+  template <typename AllocChunk>
+  bool add_chunk(std::uint32_t chunk, AllocChunk &&alloc_chunk) noexcept {
+    if (chunk == MAX_CHUNKS)
+      return false;
+
+    auto mem = static_cast<Entry *>(alloc_chunk());
+    if (mem == nullptr)
+      return false;
+
+    for (std::uint32_t i = 0; i < CHUNK_SIZE; i++)
+      new (mem + i) Entry{};
+    m_chunks[chunk] = mem;
+    return true;
+  }
+
+  SpinLock m_mtx = {};
+  // Index of the first free entry plus one, or 0.
+  std::uint32_t m_free = 0;
+  std::atomic<std::uint32_t> m_size = 0;
+  Entry *m_chunks[MAX_CHUNKS] = {};
+};
+} // namespace sheap::detail
@@ -3,32 +3,118 @@
 #include "Context.h"
 #include "Page.h"
 #include "PageAllocator.h"
+#include "Quota.h"
 #include "SpinLock.h"
+#include "Trace.h"
 
 #include <array>
 #include <atomic>
+#include <iterator>
 #include <utility>
 
 namespace sheap::detail {
 constexpr auto MIN_FREE_OBJS = 50;
 
-class UsedPageStore {
+class alignas(CACHELINE_SIZE) UsedPageStore {
 public:
+  static constexpr int NUM_BUCKETS = 4;
+
   std::pair<FreePageList, FreePageList> alloc(Context &cxt) noexcept {
     auto purgable_pages = get_purgable_pages(cxt);
     std::lock_guard lock{m_mtx};
     return {get_partial_pages(), std::move(purgable_pages)};
   }
 
+  // Fails rather than wait for the lock, setting `contended`, and leaves the
+  // deferred frees, however many there are, for later.
+  FreePageList try_alloc(bool &contended) noexcept {
+    std::unique_lock lock{m_mtx, std::try_to_lock};
+    if (!lock) {
+      contended = true;
+      return {};
+    }
+    return get_partial_pages();
+  }
+
   void push_full_pages(FreePageList &pages) noexcept {
     std::lock_guard lock{m_mtx};
-    for (auto it = pages.begin(), end = pages.end(); it != end;) {
-      auto &page = *it;
-      it = pages.erase(it);
-      PageList::node_algorithms::init(&page);
+    push_full_pages_locked(pages);
+  }
+
+  // Takes back pages of a thread cache, full or not. The empty ones are
+  // returned, to be purged.
+  FreePageList push_pages(FreePageList &pages) noexcept {
+    FreePageList empty;
+    std::lock_guard lock{m_mtx};
+
+    while (!pages.empty()) {
+      auto &page = pages.front();
+      pages.pop_front();
+
+      if (page.is_empty()) {
+        empty.push_front(page);
+      } else {
+        adopt(page);
+      }
+    }
+    return empty;
+  }
+  void try_push_full_pages(FreePageList &pages, bool &contended) noexcept {
+    std::unique_lock lock{m_mtx, std::try_to_lock};
+    if (!lock) {
+      contended = true;
+      return;
+    }
+    push_full_pages_locked(pages);
+  }
+
+  // Allocates from `page` in place, if it is still on this bin's lists and
+  // not full. The page is only known to be `owner`'s with the lock held.
+  void *alloc_from(Page &page, const Heap *owner, int bin_id) noexcept {
+    std::lock_guard lock{m_mtx};
+    if (page.get_heap() != owner || !page.is_in_heap() ||
+        page.get_size_class().binid != bin_id || page.is_full())
+      return nullptr;
+
+    auto old_bucket = get_bucket(page);
+    auto mem = page.alloc();
+
+    if (page.is_full()) {
+      page.page_list_hook::unlink();
       m_full_pages.push_back(page);
-      page.move_into_heap();
+    } else if (auto bucket = get_bucket(page); bucket != old_bucket) {
+      page.page_list_hook::unlink();
+      m_partial_pages[bucket].push_back(page);
     }
+    return mem;
+  }
+
+  // Unlinks the partial pages with at most `max_occupancy` of their objects
+  // in use, for those to be moved elsewhere, unless there is no other partial
+  // page they could be packed into.
+  FreePageList take_sparse_pages(double max_occupancy) noexcept {
+    FreePageList pages;
+    std::lock_guard lock{m_mtx};
+    std::size_t num_partial = 0;
+
+    for (auto &bucket : m_partial_pages)
+      num_partial += bucket.size();
+    if (num_partial < 2)
+      return pages;
+
+    for (auto &bucket : m_partial_pages) {
+      for (auto it = bucket.begin(); it != bucket.end();) {
+        auto &page = *it++;
+        auto num_objs = page.get_size_class().num_objs;
+
+        if (num_objs - page.num_free() <= max_occupancy * num_objs) {
+          page.page_list_hook::unlink();
+          page.move_outof_heap();
+          pages.push_front(page);
+        }
+      }
+    }
+    return pages;
   }
 
   void deferred_free(object *obj) noexcept {
@@ -42,23 +128,84 @@ public:
     }
   }
 
-  FreePageList get_purgable_pages(Context &cxt) {
+  // Recovery: forgets both lists and drops the lock. Returns whether the lock
+  // was held, in which case the free counts of this bin's pages are suspect.
+  bool reset() noexcept {
+    auto was_locked = m_mtx.is_locked();
+    m_mtx.reset();
+    new (&m_full_pages) PageList{};
+    for (auto &bucket : m_partial_pages)
+      new (&bucket) PageList{};
+    return was_locked;
+  }
+  // For Sheap::lock_for_fork().
+  [[nodiscard]] SpinLock &get_lock() noexcept { return m_mtx; }
+
+  void adopt(Page &page) noexcept {
+    BOOST_ASSERT(!page.is_empty());
+    PageList::node_algorithms::init(&page);
+    page.move_into_heap();
+    if (page.is_full()) {
+      m_full_pages.push_back(page);
+    } else {
+      m_partial_pages[get_bucket(page)].push_back(page);
+    }
+  }
+
+  template <typename Fn> void for_each_page(Fn &&fn) noexcept {
     std::lock_guard lock{m_mtx};
-    auto deferred = get_deferred();
-    auto [purgable_pages, deferred_again] = apply_deferred_free(deferred, cxt);
+    for (auto &page : m_full_pages)
+      fn(page);
+    for (auto &bucket : m_partial_pages) {
+      for (auto &page : bucket)
+        fn(page);
+    }
+  }
 
-    if (deferred_again.head) {
-      BOOST_ASSERT(deferred_again.tail != nullptr);
-      while (true) {
-        auto old = m_deferred_free.load(std::memory_order_acquire);
-        deferred_again.tail->set_next(old);
+  // Calls fn(page) with the lock held, if `page` is on this bin's lists and
+  // `owner`'s by then.
+  template <typename Fn>
+  bool with_page_locked(Page &page, const Heap *owner, int bin_id,
+                        Fn &&fn) noexcept {
+    std::lock_guard lock{m_mtx};
+    if (!page.is_in_heap() || page.get_heap() != owner ||
+        page.get_size_class().binid != bin_id)
+      return false;
 
-        if (m_deferred_free.compare_exchange_strong(old, deferred_again.head))
-          break;
-        BOOST_INTERPROCESS_SMT_PAUSE;
-      }
+    fn(page);
+    return true;
+  }
+
+  [[nodiscard]] bool has_deferred() const noexcept {
+    return m_deferred_free.load(std::memory_order_relaxed) != nullptr;
+  }
+
+  // Only for a heap nobody is using: the list is read in place.
+  template <typename Fn> void for_each_deferred(Fn &&fn) noexcept {
+    for (auto obj = m_deferred_free.load(); obj; obj = obj->get_next())
+      fn(static_cast<void *>(obj));
+  }
+
+  // Like for_each_deferred(), for a heap in use: the list is taken, so that
+  // nobody applies it meanwhile, and put back. Frees that come in meanwhile
+  // are left out.
+  template <typename Fn> void for_each_deferred_locked(Fn &&fn) noexcept {
+    std::lock_guard lock{m_mtx};
+    auto deferred = slist{get_deferred(), nullptr};
+
+    for (auto obj = deferred.head; obj; obj = obj->get_next()) {
+      fn(static_cast<void *>(obj));
+      deferred.tail = obj;
     }
+    put_back(deferred);
+  }
 
+  FreePageList get_purgable_pages(Context &cxt) {
+    std::lock_guard lock{m_mtx};
+    auto deferred = get_deferred();
+    auto [purgable_pages, deferred_again] = apply_deferred_free(deferred, cxt);
+
+    put_back(deferred_again);
     return std::move(purgable_pages);
   }
 
@@ -75,24 +222,64 @@ private:
     }
   };
 
+  void push_full_pages_locked(FreePageList &pages) noexcept {
+    for (auto it = pages.begin(), end = pages.end(); it != end;) {
+      auto &page = *it;
+      it = pages.erase(it);
+      PageList::node_algorithms::init(&page);
+      m_full_pages.push_back(page);
+      page.move_into_heap();
+    }
+  }
+
+  // The fullest pages are handed out, and used, first, so that sparse ones
+  // are left alone to drain and can be given back once empty.
   FreePageList get_partial_pages() {
     std::size_t num_objs = 0;
     FreePageList pages;
 
-    while (!m_partial_pages.empty() && num_objs < MIN_FREE_OBJS) {
-      auto &page = m_partial_pages.front();
-      BOOST_ASSERT(!page.is_empty() && !page.is_full());
-      BOOST_ASSERT(page.is_in_heap());
+    for (auto b = NUM_BUCKETS - 1; b >= 0 && num_objs < MIN_FREE_OBJS; b--) {
+      auto &bucket = m_partial_pages[b];
 
-      page.move_outof_heap();
-      m_partial_pages.pop_front();
-      pages.push_front(page);
-      num_objs += page.num_free();
+      while (!bucket.empty() && num_objs < MIN_FREE_OBJS) {
+        auto &page = bucket.front();
+        BOOST_ASSERT(!page.is_empty() && !page.is_full());
+        BOOST_ASSERT(page.is_in_heap());
+
+        page.move_outof_heap();
+        bucket.pop_front();
+        pages.push_back(page);
+        num_objs += page.num_free();
+      }
     }
 
     return pages;
   }
 
+  // Partial pages are kept in NUM_BUCKETS lists by the share of their
+  // objects in use.
+  static int get_bucket(const Page &page) noexcept {
+    auto num_objs = page.get_size_class().num_objs;
+    return (num_objs - page.num_free()) * NUM_BUCKETS / num_objs;
+  }
+
+  // Returns frees taken off m_deferred_free, ahead of those that came in
+  // since.
+  void put_back(const slist &objs) noexcept {
+    if (objs.head == nullptr)
+      return;
+
+    BOOST_ASSERT(objs.tail != nullptr);
+    while (true) {
+      auto old = m_deferred_free.load(std::memory_order_acquire);
+      objs.tail->set_next(old);
+
+      if (m_deferred_free.compare_exchange_strong(old, objs.head))
+        break;
+      BOOST_INTERPROCESS_SMT_PAUSE;
+    }
+  }
+
   object *get_deferred() {
     while (true) {
       auto freed = m_deferred_free.load(std::memory_order_acquire);
@@ -110,8 +297,9 @@ private:
       -> std::pair<FreePageList, slist> {
     FreePageList purgable_pages;
     slist deferred_again;
+    [[maybe_unused]] std::size_t num_objs = 0;
 
-    for (auto obj = deferred; obj;) {
+    for (auto obj = deferred; obj; num_objs++) {
       auto next = obj->get_next();
       auto page = cxt.get_page(obj);
 
@@ -130,6 +318,7 @@ private:
       obj = next;
     }
 
+    SHEAP_PROBE(apply_deferred_free, this, num_objs, purgable_pages.size());
     return {std::move(purgable_pages), deferred_again};
   }
 
@@ -140,49 +329,240 @@ private:
       return false;
 
     auto was_full = page->is_full();
+    auto old_bucket = was_full ? -1 : get_bucket(*page);
 
     obj->unpoison();
     page->free(obj);
     obj->poison();
 
-    if (was_full && !page->is_empty()) {
+    if (page->is_empty())
+      return true;
+
+    if (auto bucket = get_bucket(*page); bucket != old_bucket) {
       BOOST_ASSERT(page->page_list_hook::is_linked());
       page->page_list_hook::unlink();
-      m_partial_pages.push_back(*page);
+      m_partial_pages[bucket].push_back(*page);
     }
 
     return true;
   }
 
+  // Pushed to by every remote free without the lock, hence its own line.
+  alignas(CACHELINE_SIZE) std::atomic<object *> m_deferred_free = {};
+
+  // The lists are only touched with m_mtx held, so they share its lines.
+  alignas(CACHELINE_SIZE) SpinLock m_mtx = {};
   PageList m_full_pages = {};
-  PageList m_partial_pages = {};
-  std::atomic<object *> m_deferred_free = {};
-  SpinLock m_mtx = {};
+  std::array<PageList, NUM_BUCKETS> m_partial_pages = {};
 };
 
-class Heap {
+static_assert(sizeof(UsedPageStore) == 3 * CACHELINE_SIZE);
+static_assert(alignof(UsedPageStore) == CACHELINE_SIZE);
+
+class alignas(CACHELINE_SIZE) Heap {
 public:
-  Heap(Context &cxt, PageAllocator &page_alloc)
-      : m_cxt(cxt), m_page_alloc(page_alloc) {}
+  Heap(Context &cxt, PageAllocator &page_alloc, Quota &quota)
+      : m_cxt(cxt), m_page_alloc(page_alloc), m_quota(quota) {}
 
-  FreePageList alloc_pages(int bin_id) noexcept {
+  FreePageList alloc_pages(int bin_id, bool over_soft_limit = false) noexcept {
     if (auto pages = alloc_partial_pages(bin_id); BOOST_LIKELY(!pages.empty()))
       return pages;
 
     if (auto pages = alloc_from_cache(bin_id); BOOST_LIKELY(!pages.empty()))
       return pages;
 
-    return alloc_fresh_pages(bin_id);
+    return alloc_fresh_pages(bin_id, over_soft_limit);
+  }
+
+  // Like alloc_pages(), but never waits for a lock and takes at most one
+  // fresh page, so that it runs in bounded time. Neither applies deferred
+  // frees nor looks beyond this heap. Sets `contended` if a lock was busy.
+  FreePageList try_alloc_pages(int bin_id, bool &contended) noexcept {
+    if (auto pages = m_used_page_store[bin_id].try_alloc(contended);
+        !pages.empty())
+      return pages;
+
+    if (std::unique_lock lock{m_cache_mtx, std::try_to_lock}; lock) {
+      if (auto pages = take_cached_pages(bin_id); !pages.empty())
+        return pages;
+    } else {
+      contended = true;
+    }
+
+    auto &szc = m_cxt.get_size_class(bin_id);
+    FreePageList pages;
+
+    if (!m_quota.charge(pow2(szc.page_order), false))
+      return pages;
+
+    if (auto page = m_page_alloc.try_alloc(szc.page_order, contended)) {
+      page->init(szc, m_cxt.get_page_ptr(page), this);
+      pages.push_front(*page);
+    } else {
+      m_quota.uncharge(pow2(szc.page_order));
+    }
+
+    return pages;
   }
 
   void push_full_pages(int bin_id, FreePageList &pages) noexcept {
+    // Pages borrowed from another heap go back to it, as its lock guards
+    // them against concurrent frees.
+    for (auto prev = pages.before_begin(); std::next(prev) != pages.end();) {
+      if (auto owner = std::next(prev)->get_heap(); owner != this) {
+        FreePageList borrowed;
+        borrowed.splice_after(borrowed.before_begin(), pages, prev);
+        owner->m_used_page_store[bin_id].push_full_pages(borrowed);
+      } else {
+        prev++;
+      }
+    }
+
     m_used_page_store[bin_id].push_full_pages(pages);
   }
 
+  // Takes back the pages of a thread cache being flushed.
+  void push_pages(int bin_id, FreePageList &pages) noexcept {
+    for (auto prev = pages.before_begin(); std::next(prev) != pages.end();) {
+      if (auto owner = std::next(prev)->get_heap(); owner != this) {
+        FreePageList borrowed;
+        borrowed.splice_after(borrowed.before_begin(), pages, prev);
+        owner->push_pages(bin_id, borrowed);
+      } else {
+        prev++;
+      }
+    }
+
+    auto empty = m_used_page_store[bin_id].push_pages(pages);
+    purge_pages(empty);
+  }
+
+  // Like push_full_pages(), but leaves `pages` alone rather than wait for a
+  // lock or return borrowed pages to their owners.
+  void try_push_full_pages(int bin_id, FreePageList &pages,
+                           bool &contended) noexcept {
+    for (auto &page : pages) {
+      if (page.get_heap() != this)
+        return;
+    }
+
+    m_used_page_store[bin_id].try_push_full_pages(pages, contended);
+  }
+
+  // A run of 2^order base pages for an arena: a cached one if there is one,
+  // else a fresh one charged to the quota.
+  Page *alloc_arena_page(int order) noexcept {
+    Page *page = nullptr;
+
+    if (std::lock_guard lock{m_cache_mtx}; !m_free_page_cache[order].empty()) {
+      page = &m_free_page_cache[order].front();
+      m_free_page_cache[order].pop_front();
+      m_num_cached_pages--;
+    }
+
+    if (page == nullptr && m_quota.charge(pow2(order), false)) {
+      page = m_page_alloc.alloc(order);
+      if (page == nullptr)
+        m_quota.uncharge(pow2(order));
+    }
+
+    if (page != nullptr) {
+      page->init_free_span(pow2(order));
+      page->set_state(PageState::ARENA);
+    }
+    return page;
+  }
+  void free_arena_pages(FreePageList &pages) noexcept { release_pages(pages); }
+
+  // Allocates from `page` in place if this heap holds it on its lists, e.g.
+  // to keep an object next to the one it is used with.
+  void *alloc_from(int bin_id, Page &page) noexcept {
+    return m_used_page_store[bin_id].alloc_from(page, this, bin_id);
+  }
+
+  // The sparse partial pages of a bin, after applying its pending frees, for
+  // Sheap::compact() to move their objects out of. They go back through
+  // push_pages().
+  FreePageList take_sparse_pages(int bin_id, double max_occupancy) noexcept {
+    auto &ps = m_used_page_store[bin_id];
+    auto pages = ps.get_purgable_pages(m_cxt);
+
+    purge_pages(pages);
+    return ps.take_sparse_pages(max_occupancy);
+  }
+
+  // Partial pages for a thread of another heap, which is out of pages.
+  FreePageList lend_partial_pages(int bin_id) noexcept {
+    return alloc_partial_pages(bin_id);
+  }
+
   void deferred_free(int bin_id, void *obj) noexcept {
     m_used_page_store[bin_id].deferred_free(static_cast<object *>(obj));
   }
 
+  // Recovery: forgets every page list and drops every lock, recording in
+  // `suspect` the bins whose lock was held.
+  void reset(std::array<bool, NUM_BINS> &suspect) noexcept {
+    for (int i = 0; i < NUM_BINS; i++)
+      suspect[i] = m_used_page_store[i].reset();
+
+    m_cache_mtx.reset();
+    m_num_cached_pages = 0;
+    for (auto &cache : m_free_page_cache)
+      new (&cache) FreePageList{};
+  }
+
+  // Calls fn(lock) for every lock of the heap, in the order they nest in.
+  template <typename Fn> void for_each_lock(Fn &&fn) noexcept {
+    for (auto &ps : m_used_page_store)
+      fn(ps.get_lock());
+    fn(m_cache_mtx);
+  }
+
+  void adopt_page(Page &page) noexcept {
+    m_used_page_store[page.get_size_class().binid].adopt(page);
+    m_quota.charge(page.num_base_pages(), true);
+  }
+
+  [[nodiscard]] Quota &get_quota() const noexcept { return m_quota; }
+
+  // Calls fn(page) for every page on this heap's lists, one bin at a time
+  // with the bin's pending frees applied and its lock held.
+  template <typename Fn> void for_each_page(Fn &&fn) noexcept {
+    for (auto &ps : m_used_page_store) {
+      auto pages = ps.get_purgable_pages(m_cxt);
+      purge_pages(pages);
+      ps.for_each_page(fn);
+    }
+  }
+
+  template <typename Fn> void for_each_deferred(Fn &&fn) noexcept {
+    for (auto &ps : m_used_page_store)
+      ps.for_each_deferred(fn);
+  }
+
+  // Calls fn(page) with the page's bin locked, if it is on this heap's lists
+  // by then, for a walk that came across it in the page array.
+  template <typename Fn> bool with_page_locked(Page &page, Fn &&fn) noexcept {
+    auto szc = page.racy_size_class();
+    return szc != nullptr && m_used_page_store[szc->binid].with_page_locked(
+                                 page, this, szc->binid, fn);
+  }
+
+  template <typename Fn> void for_each_deferred_locked(Fn &&fn) noexcept {
+    for (auto &ps : m_used_page_store)
+      ps.for_each_deferred_locked(fn);
+  }
+
+  // Whether collect_garbage(true) would find anything to give back, as far
+  // as can be told without a lock.
+  [[nodiscard]] bool has_garbage() const noexcept {
+    if (racy_load(&m_num_cached_pages) != 0)
+      return true;
+    return std::any_of(m_used_page_store.begin(), m_used_page_store.end(),
+                       [](auto &ps) { return ps.has_deferred(); });
+  }
+
   void collect_garbage(bool flushcache) noexcept {
     for (auto &ps : m_used_page_store) {
       auto pages = ps.get_purgable_pages(m_cxt);
@@ -193,6 +573,25 @@ public:
       flush_cache();
   }
 
+  void flush_cache() noexcept {
+    FreePageList pages;
+    std::lock_guard lock{m_cache_mtx};
+    SHEAP_PROBE(flush_cache, this, m_num_cached_pages);
+
+    for (auto &cache : m_free_page_cache) {
+      while (!cache.empty()) {
+        auto &page = cache.front();
+        BOOST_ASSERT(page.is_empty());
+        BOOST_ASSERT(!page.is_in_heap());
+        cache.pop_front();
+        pages.push_front(page);
+      }
+    }
+    m_num_cached_pages = 0;
+
+    release_pages(pages);
+  }
+
 private:
   FreePageList alloc_partial_pages(int bin_id) {
     auto [pages, purgable_pages] = m_used_page_store[bin_id].alloc(m_cxt);
@@ -203,16 +602,24 @@ private:
 
   FreePageList alloc_from_cache(int bin_id) {
     std::lock_guard lock{m_cache_mtx};
+    return take_cached_pages(bin_id);
+  }
+
+  // With m_cache_mtx held.
+  FreePageList take_cached_pages(int bin_id) {
+    auto &szc = m_cxt.get_size_class(bin_id);
+    auto &cache = m_free_page_cache[szc.page_order];
     FreePageList pages;
     int num_objs = 0;
 
-    while (!m_free_page_cache.empty() && num_objs < MIN_FREE_OBJS) {
-      auto &page = m_free_page_cache.front();
+    while (!cache.empty() && num_objs < MIN_FREE_OBJS) {
+      auto &page = cache.front();
       BOOST_ASSERT(page.is_empty());
       BOOST_ASSERT(!page.is_in_heap());
 
-      m_free_page_cache.pop_front();
-      page.init(m_cxt.get_size_class(bin_id), m_cxt.get_page_ptr(&page), this);
+      cache.pop_front();
+      m_num_cached_pages--;
+      page.init(szc, m_cxt.get_page_ptr(&page), this);
       pages.push_front(page);
       num_objs += page.num_free();
     }
@@ -220,21 +627,28 @@ private:
     return pages;
   }
 
-  FreePageList alloc_fresh_pages(int bin_id) {
+  FreePageList alloc_fresh_pages(int bin_id, bool over_soft_limit) {
+    auto &szc = m_cxt.get_size_class(bin_id);
     FreePageList pages;
     int num_objs = 0;
 
     while (num_objs < MIN_FREE_OBJS) {
-      auto page = m_page_alloc.alloc();
+      if (!m_quota.charge(pow2(szc.page_order), over_soft_limit))
+        break;
 
-      if (page == nullptr)
+      auto page = m_page_alloc.alloc(szc.page_order);
+
+      if (page == nullptr) {
+        m_quota.uncharge(pow2(szc.page_order));
         break;
+      }
 
-      page->init(m_cxt.get_size_class(bin_id), m_cxt.get_page_ptr(page), this);
+      page->init(szc, m_cxt.get_page_ptr(page), this);
       pages.push_front(*page);
       num_objs += page->num_free();
     }
 
+    SHEAP_PROBE(alloc_fresh_pages, this, bin_id, pages.size());
     return pages;
   }
 
@@ -242,40 +656,43 @@ private:
     if (pages.empty())
       return;
 
+    SHEAP_PROBE(purge_pages, this, pages.size());
     std::lock_guard lock{m_cache_mtx};
-    for (auto size = m_free_page_cache.size();
-         !pages.empty() && size < NUM_CACHED_PAGES; size++) {
+    while (!pages.empty() && m_num_cached_pages < NUM_CACHED_PAGES) {
       auto &page = pages.front();
       BOOST_ASSERT(page.is_empty());
       BOOST_ASSERT(!page.is_in_heap());
       pages.pop_front();
-      m_free_page_cache.push_front(page);
+      page.set_state(PageState::CACHED);
+      m_free_page_cache[page.page_order()].push_front(page);
+      m_num_cached_pages++;
     }
-    m_page_alloc.free(pages);
+    release_pages(pages);
+    m_page_alloc.get_waiters().notify();
   }
 
-  void flush_cache() {
-    FreePageList pages;
-    std::lock_guard lock{m_cache_mtx};
-
-    while (!m_free_page_cache.empty()) {
-      auto &page = m_free_page_cache.front();
-      BOOST_ASSERT(page.is_empty());
-      BOOST_ASSERT(!page.is_in_heap());
-      m_free_page_cache.pop_front();
-      pages.push_front(page);
-    }
+  void release_pages(FreePageList &pages) {
+    std::size_t num_pages = 0;
+    for (auto &page : pages)
+      num_pages += page.num_base_pages();
 
+    m_quota.uncharge(num_pages);
     m_page_alloc.free(pages);
   }
 
   Context &m_cxt;
-  std::array<UsedPageStore, NUM_BINS> m_used_page_store;
   PageAllocator &m_page_alloc;
+  Quota &m_quota;
+  std::array<UsedPageStore, NUM_BINS> m_used_page_store;
 
-  FreePageList m_free_page_cache = {};
-  SpinLock m_cache_mtx = {};
+  // Empty pages, kept by order so that a bin only reuses pages of its size.
+  alignas(CACHELINE_SIZE) SpinLock m_cache_mtx = {};
+  int m_num_cached_pages = 0;
+  std::array<FreePageList, NUM_PAGE_ORDERS> m_free_page_cache = {};
 
   static constexpr int NUM_CACHED_PAGES = 100;
 };
+
+static_assert(sizeof(Heap) % CACHELINE_SIZE == 0);
+static_assert(alignof(Heap) == CACHELINE_SIZE);
 } // namespace sheap::detail
\ No newline at end of file
@@ -3,9 +3,12 @@
 #include "SizeClass.h"
 #include "utils.h"
 
+#include <algorithm>
+#include <atomic>
+#include <boost/align/align_down.hpp>
 #include <boost/intrusive/list.hpp>
 #include <boost/intrusive/slist.hpp>
-#include <boost/pool/simple_segregated_storage.hpp>
+#include <cstdint>
 
 namespace sheap::detail {
 using normal_link = boost::intrusive::link_mode<boost::intrusive::normal_link>;
@@ -13,45 +16,131 @@ using auto_unlink = boost::intrusive::link_mode<boost::intrusive::auto_unlink>;
 using page_list_hook = boost::intrusive::list_base_hook<auto_unlink>;
 using free_list_hook = boost::intrusive::slist_base_hook<normal_link>;
 
+// Where a page currently lives. Kept up to date so that the page lists can be
+// rebuilt from the page array alone, see Sheap::recover().
+enum class PageState : std::uint8_t {
+  FREE,   // In the PageAllocator, or on its way there.
+  CACHED, // In a heap's cache of empty pages.
+  THREAD, // Owned by a thread cache.
+  HEAP,   // On a UsedPageStore list.
+  ARENA,  // Bump allocated by an arena.
+};
+
 class Heap;
-class Page : public page_list_hook, public free_list_hook {
+class alignas(CACHELINE_SIZE) Page : public page_list_hook,
+                                    public free_list_hook {
 public:
   Page(const Page &) = delete;
   Page(Page &&) = delete;
 
   void init(const SizeClass &szc, void *page_base, Heap *heap) noexcept {
     asan_unpoison_memory_region(this, sizeof(*this));
+    BOOST_ASSERT(num_base_pages() == pow2(szc.page_order));
+    // Only the first use of a fresh run starts out zero; later ones find
+    // what the previous left.
+    auto zeroed = m_flags & FRESH ? ZEROED : 0;
     new (this) Page{szc, page_base, heap};
+    m_flags = zeroed;
   }
 
-  static inline Page *get_null_page() noexcept {
-    static Page page;
-    return &page;
+  // A page covers a run of base pages, each of which has a descriptor so that
+  // any address can be mapped to its page in O(1). The first descriptor is
+  // the page proper; the others only record the distance back to it. The low
+  // bit of m_span tells the two apart.
+  void init_span(std::size_t num_base_pages) noexcept {
+    init_free_span(num_base_pages);
+
+    for (std::size_t i = 1; i < num_base_pages; i++)
+      this[i].init_span_tail(i);
+  }
+  void init_free_span(std::size_t num_base_pages) noexcept {
+    asan_unpoison_memory_region(this, sizeof(*this));
+    new (this) Page{static_cast<std::uint16_t>(num_base_pages << 1)};
   }
 
-  [[nodiscard]] bool is_null() const noexcept {
-    return this == get_null_page();
+  [[nodiscard]] Page *get_span_head() noexcept {
+    auto dist = (m_span >> 1) & -(m_span & SPAN_TAIL);
+    return this - dist;
+  }
+  [[nodiscard]] std::size_t num_base_pages() const noexcept {
+    BOOST_ASSERT(!(m_span & SPAN_TAIL));
+    return m_span >> 1;
+  }
+  [[nodiscard]] int page_order() const noexcept {
+    return log2(num_base_pages());
   }
 
+  // A run of no pages, with nothing to allocate, that thread caches point
+  // at while they hold no page so that the fast path needs no extra check.
+  // It lives in the heap, as its address is shared by every process.
+  void init_null() noexcept { init_free_span(0); }
+  [[nodiscard]] bool is_null() const noexcept { return m_span == 0; }
+
+  // Objects are handed out from the free list first and only then from the
+  // never-used tail of the page. The tail is not formatted up front, so fresh
+  // memory is neither written nor faulted in until it is actually allocated.
   void *alloc() noexcept {
     BOOST_ASSERT(m_szc != nullptr ? m_num_free <= m_szc->num_objs : true);
 
-    if (BOOST_UNLIKELY(m_freelist.empty()))
+    if (BOOST_UNLIKELY(m_num_free == 0))
       return nullptr;
 
-    BOOST_ASSERT(this != Page::get_null_page());
-    BOOST_ASSERT(m_num_free > 0);
+    BOOST_ASSERT(!is_null());
     m_num_free--;
-    return alloc(m_freelist);
+
+    void *ret;
+    if (m_freelist != nullptr) {
+      ret = pop_free();
+    } else {
+      ret = m_bump;
+      m_bump += m_szc->bin.size;
+    }
+
+    // The page is updated before the caller writes to the object, for
+    // snapshot_allocated() to notice.
+    std::atomic_thread_fence(std::memory_order_release);
+    return ret;
   }
   void free(void *obj) noexcept {
     BOOST_ASSERT(m_num_free != m_szc->num_objs);
-    m_freelist.free(obj);
+    *static_cast<void **>(obj) = m_freelist;
+    m_freelist = obj;
     m_num_free++;
   }
 
-  void set_has_aligned() noexcept { m_has_aligned = true; }
-  [[nodiscard]] bool has_aligned() const noexcept { return m_has_aligned; }
+  // Faults in the never-used tail, so that allocating from it later takes no
+  // page faults. Only for a page owned by the caller.
+  void prefault(void *page_base) noexcept {
+    auto end = static_cast<std::byte *>(page_base) +
+               m_szc->num_objs * m_szc->bin.size;
+
+    for (auto p = m_bump; p < end; p += OS_PAGE_SIZE) {
+      asan_unpoison_memory_region(p, 1);
+      *static_cast<volatile std::byte *>(p) = std::byte{};
+      asan_poison_memory_region(p, 1);
+      p = static_cast<std::byte *>(boost::alignment::align_down(
+          static_cast<void *>(p), OS_PAGE_SIZE));
+    }
+  }
+
+  // Set by the page allocator on a run of zeroed memory never used before.
+  void set_fresh() noexcept { m_flags |= FRESH; }
+  // Whether the next object alloc() returns is zero: one off the never-used
+  // tail of a page that was fresh when initialised.
+  [[nodiscard]] bool is_next_zeroed() const noexcept {
+    return (m_flags & ZEROED) && m_freelist == nullptr && m_num_free != 0;
+  }
+
+  void set_has_aligned() noexcept { m_flags |= HAS_ALIGNED; }
+  [[nodiscard]] bool has_aligned() const noexcept {
+    return m_flags & HAS_ALIGNED;
+  }
+  // Set once an object of the page was sampled by the profiler, so that frees
+  // from other pages need not look theirs up.
+  void set_has_sampled() noexcept { m_flags |= HAS_SAMPLED; }
+  [[nodiscard]] bool has_sampled() const noexcept {
+    return m_flags & HAS_SAMPLED;
+  }
 
   [[nodiscard]] bool is_empty() const noexcept {
     return m_num_free == m_szc->num_objs;
@@ -62,37 +151,183 @@ public:
   [[nodiscard]] const SizeClass &get_size_class() const noexcept {
     return *m_szc;
   }
-  [[nodiscard]] bool is_in_heap() const noexcept { return m_is_in_heap; }
-  void move_into_heap() noexcept { m_is_in_heap = true; }
-  void move_outof_heap() noexcept { m_is_in_heap = false; }
+  [[nodiscard]] bool is_in_heap() const noexcept {
+    return m_state == PageState::HEAP;
+  }
+  // For walks alongside allocation, which read descriptors that are being
+  // changed, and check afterwards.
+  [[nodiscard]] PageState racy_state() const noexcept {
+    return racy_load(&m_state);
+  }
+  [[nodiscard]] Heap *racy_heap() const noexcept { return racy_load(&m_heap); }
+  [[nodiscard]] const SizeClass *racy_size_class() const noexcept {
+    return racy_load(&m_szc);
+  }
+  void move_into_heap() noexcept { m_state = PageState::HEAP; }
+  void move_outof_heap() noexcept { m_state = PageState::THREAD; }
+  [[nodiscard]] PageState get_state() const noexcept { return m_state; }
+  void set_state(PageState state) noexcept { m_state = state; }
+
+  // Recomputes the free count from the free list and the bump frontier, for
+  // pages whose owner may have died between updating one and the other.
+  void recount_free(void *page_base) noexcept {
+    auto end = static_cast<std::byte *>(page_base) +
+               m_szc->num_objs * m_szc->bin.size;
+    std::size_t num_free = (end - m_bump) / m_szc->bin.size;
+
+    for (auto obj = m_freelist; obj; num_free++) {
+      asan_unpoison_memory_region(obj, sizeof(void *));
+      auto next = *static_cast<void **>(obj);
+      asan_poison_memory_region(obj, sizeof(void *));
+      obj = next;
+    }
+
+    m_num_free = num_free;
+  }
+
+  // Calls fn(obj) for every allocated object. The free list is chased once to
+  // mark free slots in `bitmap`, which must hold num_objs bits; the objects
+  // are then found by scanning the bitmap a word at a time.
+  template <typename Fn>
+  void for_each_allocated(void *page_base, std::uint64_t *bitmap,
+                          Fn &&fn) const noexcept {
+    auto base = static_cast<std::byte *>(page_base);
+    auto size = m_szc->bin.size;
+    std::size_t num_used = (m_bump - base) / size;
+
+    std::fill_n(bitmap, (num_used + 63) / 64, 0);
+    for (auto obj = m_freelist; obj;) {
+      std::size_t idx = (static_cast<std::byte *>(obj) - base) / size;
+      bitmap[idx / 64] |= UINT64_C(1) << idx % 64;
+
+      asan_unpoison_memory_region(obj, sizeof(void *));
+      auto next = *static_cast<void **>(obj);
+      asan_poison_memory_region(obj, sizeof(void *));
+      obj = next;
+    }
+
+    for_each_unmarked(base, size, num_used, bitmap, fn);
+  }
+
+  // Like for_each_allocated(), for a page a thread may be allocating from
+  // meanwhile, calling fn(obj, size). The page is read without a lock and the
+  // reading only used if the page is unchanged afterwards; Page::alloc()
+  // orders its updates ahead of any write to the object it returns. Returns
+  // false, having called nothing, if the page changed or is not a thread's.
+  // A free list that is not one, as left by a write after free, is skipped.
+  template <typename Fn>
+  bool snapshot_allocated(void *page_base, std::uint64_t *bitmap,
+                          Fn &&fn) const noexcept {
+    auto state = racy_load(&m_state);
+    auto szc = racy_load(&m_szc);
+    auto num_free = racy_load(&m_num_free);
+    auto bump = racy_load(&m_bump);
+    auto head = racy_load(&m_freelist);
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    auto base = static_cast<std::byte *>(page_base);
+    if (state != PageState::THREAD || szc == nullptr || bump < base ||
+        bump > base + szc->num_objs * szc->bin.size)
+      return false;
+
+    auto size = szc->bin.size;
+    std::size_t num_used = (bump - base) / size;
+    bool valid = (bump - base) % size == 0;
+
+    std::fill_n(bitmap, (num_used + 63) / 64, 0);
+    for (auto obj = static_cast<std::byte *>(head); valid && obj;) {
+      if (obj < base || obj >= bump || (obj - base) % size != 0) {
+        valid = false;
+        break;
+      }
+
+      std::size_t idx = (obj - base) / size;
+      auto bit = UINT64_C(1) << idx % 64;
+      valid = !(bitmap[idx / 64] & bit);
+      bitmap[idx / 64] |= bit;
+      obj = racy_load(reinterpret_cast<std::byte *const *>(obj));
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (racy_load(&m_state) != state || racy_load(&m_szc) != szc ||
+        racy_load(&m_num_free) != num_free || racy_load(&m_bump) != bump ||
+        racy_load(&m_freelist) != head)
+      return false;
+
+    if (valid) {
+      for_each_unmarked(base, size, num_used, bitmap,
+                        [&](void *obj) { fn(obj, size); });
+    }
+    return true;
+  }
 
 private:
+  static constexpr std::uint16_t SPAN_TAIL = 0x1;
+  static constexpr std::uint8_t HAS_ALIGNED = 0x1;
+  static constexpr std::uint8_t HAS_SAMPLED = 0x2;
+  static constexpr std::uint8_t FRESH = 0x4;
+  static constexpr std::uint8_t ZEROED = 0x8;
+
   Page() = default;
   Page(const SizeClass &szc, void *page_base, Heap *heap) noexcept
-      : m_szc(&szc), m_num_free(szc.num_objs), m_heap(heap) {
-    BOOST_ASSERT(m_freelist.empty());
-    asan_unpoison_memory_region(page_base, szc.page_size);
-    m_freelist.add_block(page_base, szc.page_size, szc.bin.size);
-    asan_poison_memory_region(page_base, szc.page_size);
-  }
-
-  static inline void *alloc(boost::simple_segregated_storage<int> &freelist) {
-    // Moasam...
-    void *first = *reinterpret_cast<void **>(&freelist);
-    asan_unpoison_memory_region(first, sizeof(void *));
-    auto ret = freelist.malloc();
-    asan_poison_memory_region(first, sizeof(void *));
-    return ret;
+      : m_bump(static_cast<std::byte *>(page_base)), m_szc(&szc),
+        m_heap(heap), m_num_free(szc.num_objs),
+        m_span(static_cast<std::uint16_t>(pow2(szc.page_order) << 1)),
+        m_state(PageState::THREAD) {}
+
+  explicit Page(std::uint16_t span) noexcept : m_span(span) {}
+
+  void init_span_tail(std::size_t dist) noexcept {
+    asan_unpoison_memory_region(this, sizeof(*this));
+    new (this) Page{static_cast<std::uint16_t>(dist << 1 | SPAN_TAIL)};
+  }
+
+  // Calls fn() for each of the first num_used objects not marked in `bitmap`.
+  template <typename Fn>
+  static void for_each_unmarked(std::byte *base, std::size_t size,
+                                std::size_t num_used,
+                                const std::uint64_t *bitmap, Fn &&fn) {
+    auto num_words = (num_used + 63) / 64;
+    for (std::size_t w = 0; w < num_words; w++) {
+      auto live = ~bitmap[w];
+      if (w == num_words - 1 && num_used % 64 != 0)
+        live &= pow2(num_used % 64) - 1;
+
+      for (; live != 0; live &= live - 1)
+        fn(base + (w * 64 + count_trailing_zeros(live)) * size);
+    }
+  }
+
+  void *pop_free() noexcept {
+    auto obj = m_freelist;
+    asan_unpoison_memory_region(obj, sizeof(void *));
+    m_freelist = *static_cast<void **>(obj);
+    asan_poison_memory_region(obj, sizeof(void *));
+    return obj;
   }
 
-  boost::simple_segregated_storage<int> m_freelist = {};
+  // Fields touched on every alloc/free are kept together and, with the list
+  // hooks, the whole descriptor fits in the line it is aligned to.
+  // A page never allocated from has an empty m_freelist and m_bump at its
+  // base; every free object below m_bump is on m_freelist.
+  void *m_freelist = nullptr;
+  std::byte *m_bump = nullptr;
   const SizeClass *m_szc = nullptr;
-  std::size_t m_num_free = 0;
   Heap *const m_heap = nullptr;
-  bool m_is_in_heap = false;
-  bool m_has_aligned = false;
+  std::uint32_t m_num_free = 0;
+  std::uint16_t m_span = 0;
+  PageState m_state = PageState::FREE;
+  std::uint8_t m_flags = 0;
 };
 
+static_assert(pow2(NUM_PAGE_ORDERS - 1) <= UINT16_MAX >> 1,
+              "span lengths must fit in Page::m_span");
+
+// Descriptors are contiguous in the page array and written by whichever thread
+// owns the page, so each one must own exactly one cache line.
+static_assert(sizeof(Page) == CACHELINE_SIZE);
+static_assert(alignof(Page) == CACHELINE_SIZE);
+
 using FreePageList =
     boost::intrusive::slist<Page, boost::intrusive::linear<false>,
                             boost::intrusive::cache_last<true>>;
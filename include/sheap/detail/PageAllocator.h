@@ -1,51 +1,284 @@
 #pragma once
 
 #include "Page.h"
+#include "RegionMap.h"
 #include "SpinLock.h"
+#include "WaitQueue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <array>
 
 namespace sheap::detail {
-class PageAllocator {
+class alignas(CACHELINE_SIZE) PageAllocator {
 public:
-  PageAllocator(Page *pagearr, std::size_t num_pages) noexcept
-      : m_pagearr(pagearr), m_num_pages(num_pages) {
+  // `zeroed` tells whether the pages of the page array are all zero, for
+  // runs carved off its never-used tail to be marked fresh.
+  PageAllocator(Page *pagearr, std::size_t num_pages, RegionMap &regions,
+                bool zeroed) noexcept
+      : m_pagearr(pagearr), m_num_pages(num_pages), m_regions(regions),
+        m_zeroed(zeroed) {
     BOOST_ASSERT(pagearr != nullptr);
     BOOST_ASSERT(num_pages != 0);
   }
 
-  Page *alloc() noexcept {
+  // Returns the first of 2^order contiguous base pages. Runs are taken from
+  // the free list of that order, then carved off the never-used tail of the
+  // page array, then split off a larger free run. Every run starts at a
+  // multiple of its length from the start of the page array or its region,
+  // so that a freed run is merged with its free buddy, and that with its own,
+  // back into runs as long as they can be.
+  Page *alloc(int order) noexcept {
     std::lock_guard lock{m_mtx};
-
-    if (!m_freelist.empty()) {
-      auto page = &m_freelist.front();
-      m_freelist.pop_front();
-      return page;
+    return alloc_locked(order);
+  }
+  // Fails rather than wait for the lock, setting `contended`.
+  Page *try_alloc(int order, bool &contended) noexcept {
+    std::unique_lock lock{m_mtx, std::try_to_lock};
+    if (!lock) {
+      contended = true;
+      return nullptr;
     }
-
-    if (m_next_page != m_num_pages)
-      return m_pagearr + m_next_page++;
-
-    return nullptr;
+    return alloc_locked(order);
   }
 
   void free(Page *page) noexcept {
-    std::lock_guard lock{m_mtx};
-    m_freelist.push_front(*page);
+    {
+      std::lock_guard lock{m_mtx};
+      free_locked(page);
+    }
+    m_waiters.notify();
   }
   void free(FreePageList &fl) noexcept {
     if (fl.empty())
       return;
 
+    {
+      std::lock_guard lock{m_mtx};
+      while (!fl.empty()) {
+        auto &page = fl.front();
+        fl.pop_front();
+        free_locked(&page);
+      }
+    }
+    m_waiters.notify();
+  }
+
+  // Allocations waiting for pages, woken by free().
+  [[nodiscard]] WaitQueue &get_waiters() noexcept { return m_waiters; }
+  // For Sheap::lock_for_fork().
+  [[nodiscard]] SpinLock &get_lock() noexcept { return m_mtx; }
+
+  // Hands the pages of a region just mapped to the free lists, in runs as
+  // long as they can be.
+  void add_region(Region &region) noexcept {
     std::lock_guard lock{m_mtx};
-    m_freelist.incorporate_after(
-        m_freelist.before_begin(), fl.front().free_list_hook::this_ptr(),
-        fl.back().free_list_hook::this_ptr(), fl.size());
+    for (std::size_t i = 0; i < region.m_num_pages;) {
+      auto order =
+          std::min(log2(region.m_num_pages - i), NUM_PAGE_ORDERS - 1);
+      auto page = region.m_pages + i;
+
+      page->init_free_span(pow2(order));
+      m_freelist[order].push_front(*page);
+      i += pow2(order);
+    }
+    region.m_num_free = region.m_num_pages;
+  }
+
+  // If no page of `region` is in use, takes all of them off the free lists
+  // so that it can be unmapped.
+  bool remove_region_if_empty(Region &region) noexcept {
+    std::lock_guard lock{m_mtx};
+    if (!region.is_empty())
+      return false;
+
+    for (auto &fl : m_freelist)
+      fl.remove_if([&](const Page &page) { return region.has_page(&page); });
+    region.m_num_free = 0;
+    return true;
+  }
+
+  // Visits the first descriptor of every run ever carved, in address order
+  // and then region by region. Runs are only ever split while their first
+  // descriptor is off every list, and the split is published last, so this
+  // is safe on a crashed heap.
+  template <typename Fn> void for_each_page(Fn &&fn) noexcept {
+    for (std::size_t i = 0; i < m_next_page;) {
+      auto page = m_pagearr + i;
+      i += page->num_base_pages();
+      fn(page);
+    }
+
+    m_regions.for_each([&](Region &region) {
+      for (std::size_t i = 0; i < region.m_num_pages;) {
+        auto page = region.m_pages + i;
+        i += page->num_base_pages();
+        fn(page);
+      }
+    });
+  }
+
+  // The descriptors of the page array carved so far, every one of which is
+  // initialised, for walks that look at them all.
+  [[nodiscard]] std::pair<Page *, std::size_t> get_carved() const noexcept {
+    return {m_pagearr, m_next_page.load(std::memory_order_acquire)};
+  }
+
+  // Drops the lock, every free list and every waiter. Recovery hands the free
+  // pages back. Their links still point into the old lists, so they are
+  // cleared before any free run is looked at as a buddy.
+  void reset() noexcept {
+    m_mtx.reset();
+    for (auto &fl : m_freelist)
+      new (&fl) PageList{};
+    for_each_page([](Page *page) {
+      if (page->get_state() == PageState::FREE)
+        PageList::node_algorithms::init(page);
+    });
+    m_regions.for_each([](Region &region) { region.m_num_free = 0; });
+    m_waiters.reset();
   }
 
 private:
+  // No free list is walked, and a split takes at most NUM_PAGE_ORDERS steps.
+  // Carving retires the few runs skipped to align the new one; the rest of
+  // the tail is retired once, when it has become too short, in runs as long
+  // as they can be.
+  Page *alloc_locked(int order) noexcept {
+    BOOST_ASSERT(order < NUM_PAGE_ORDERS);
+    auto num_base_pages = pow2(order);
+
+    if (auto page = pop(order, order))
+      return page;
+
+    if (auto start = (m_next_page + num_base_pages - 1) & -num_base_pages;
+        start < m_num_pages && m_num_pages - start >= num_base_pages) {
+      // The run is described before it is published through m_next_page,
+      // so that for_each_page() never meets an uninitialised descriptor.
+      retire_tail(start);
+      auto page = m_pagearr + m_next_page;
+      page->init_span(num_base_pages);
+      if (m_zeroed)
+        page->set_fresh();
+      m_next_page += num_base_pages;
+      return page;
+    }
+
+    // What was just retired may include a run of the order asked for.
+    retire_tail(m_num_pages);
+    for (auto larger = order; larger < NUM_PAGE_ORDERS; larger++) {
+      if (auto page = pop(larger, order))
+        return page;
+    }
+
+    return nullptr;
+  }
+
+  // Keeps the free count of the page's region, if it is in one.
+  void count_free(const Page *page, std::ptrdiff_t delta) noexcept {
+    if (BOOST_LIKELY(to_int(page) - to_int(m_pagearr) <
+                     m_num_pages * sizeof(Page)))
+      return;
+
+    if (auto region = m_regions.find(page))
+      region->m_num_free += delta;
+  }
+
+  // The pages a run is aligned within, and the buddies it may have there:
+  // those of the page array that were carved, or those of its region.
+  std::pair<Page *, std::size_t> get_range(Page *page) noexcept {
+    if (BOOST_LIKELY(to_int(page) - to_int(m_pagearr) <
+                     m_num_pages * sizeof(Page)))
+      return {m_pagearr, m_next_page};
+
+    auto region = m_regions.find(page);
+    BOOST_ASSERT(region != nullptr);
+    return {region->m_pages, region->m_num_pages};
+  }
+
+  void free_locked(Page *page) noexcept {
+    count_free(page, page->num_base_pages());
+    // It may end up inside a merged run, where nothing rewrites it, and must
+    // not look in use there.
+    page->set_state(PageState::FREE);
+
+    auto [base, num_pages] = get_range(page);
+    auto idx = static_cast<std::size_t>(page - base);
+    auto order = page->page_order();
+
+    // A buddy is the head of a run, as runs never straddle an aligned block.
+    // It is only merged while on a free list, not while handed out.
+    while (order < NUM_PAGE_ORDERS - 1 && idx % pow2(order) == 0) {
+      auto buddy_idx = idx ^ pow2(order);
+      if (buddy_idx + pow2(order) > num_pages)
+        break;
+
+      auto buddy = base + buddy_idx;
+      if (buddy->get_state() != PageState::FREE ||
+          !buddy->page_list_hook::is_linked() ||
+          buddy->num_base_pages() != pow2(order))
+        break;
+
+      buddy->page_list_hook::unlink();
+      idx = std::min(idx, buddy_idx);
+      order++;
+    }
+
+    page = base + idx;
+    page->init_free_span(pow2(order));
+    m_freelist[order].push_front(*page);
+  }
+
+  Page *pop(int order, int want_order) noexcept {
+    auto &fl = m_freelist[order];
+
+    if (fl.empty())
+      return nullptr;
+
+    auto page = &fl.front();
+    fl.pop_front();
+
+    // Keep the lowest run and give back the upper halves.
+    while (order-- > want_order) {
+      auto buddy = page + pow2(order);
+      buddy->init_free_span(pow2(order));
+      m_freelist[order].push_front(*buddy);
+    }
+
+    page->init_span(pow2(want_order));
+    count_free(page, -static_cast<std::ptrdiff_t>(pow2(want_order)));
+    return page;
+  }
+
+  // Hands the page array up to `end` to the free lists in aligned runs, the
+  // part skipped to align a run or what is left of it once too short for
+  // the current request, so that smaller orders can still use it.
+  void retire_tail(std::size_t end) noexcept {
+    while (m_next_page != end) {
+      auto order = std::min(log2(end - m_next_page), NUM_PAGE_ORDERS - 1);
+      if (m_next_page != 0)
+        order = std::min(order, count_trailing_zeros(m_next_page));
+
+      auto page = m_pagearr + m_next_page;
+      page->init_span(pow2(order));
+      m_next_page += pow2(order);
+      free_locked(page);
+    }
+  }
+
   Page *const m_pagearr;
-  FreePageList m_freelist = {};
   const std::size_t m_num_pages;
-  std::size_t m_next_page = 0;
+  RegionMap &m_regions;
+  const bool m_zeroed;
+  std::atomic<std::size_t> m_next_page = 0;
+  // Linked through page_list_hook, which free runs do not otherwise use, so
+  // that a buddy can be taken off its list in place.
+  std::array<PageList, NUM_PAGE_ORDERS> m_freelist = {};
   SpinLock m_mtx = {};
+  WaitQueue m_waiters = {};
 };
+
+// Shared by every heap; must not share a line with its neighbours.
+static_assert(sizeof(PageAllocator) % CACHELINE_SIZE == 0);
+static_assert(alignof(PageAllocator) == CACHELINE_SIZE);
 } // namespace sheap::detail
\ No newline at end of file
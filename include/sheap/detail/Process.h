@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#if __has_include(<unistd.h>)
+#include <cerrno>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// What processes sharing a heap need from the OS to wait for and keep track
+// of each other.
+namespace sheap::detail {
+// getpid() is a system call; the cached pid is refreshed in forked children.
+inline int current_pid() noexcept {
+#if __has_include(<unistd.h>)
+  static int pid = [] {
+    pthread_atfork(nullptr, nullptr, [] { pid = getpid(); });
+    return getpid();
+  }();
+  return pid;
+#else
+  return 0;
+#endif
+}
+
+// Pids are only checked where the platform can, and are assumed alive
+// otherwise, or if reused by another process.
+inline bool is_alive(int pid) noexcept {
+#if __has_include(<unistd.h>)
+  return pid == 0 || kill(pid, 0) == 0 || errno != ESRCH;
+#else
+  return true;
+#endif
+}
+
+// Blocks while `word` holds `expected`, for at most `timeout`, and may
+// return early. The word may be shared between processes. Elsewhere than on
+// Linux, sleeps for at most a millisecond at a time.
+inline void futex_wait(std::atomic<std::uint32_t> &word, std::uint32_t expected,
+                       std::chrono::nanoseconds timeout) noexcept {
+  static_assert(sizeof(word) == sizeof(std::uint32_t));
+  timeout = std::max(timeout, std::chrono::nanoseconds::zero());
+#ifdef __linux__
+  timespec ts{static_cast<std::time_t>(timeout.count() / 1'000'000'000),
+              static_cast<long>(timeout.count() % 1'000'000'000)};
+  syscall(SYS_futex, &word, FUTEX_WAIT, expected, &ts, nullptr, 0);
+#else
+  if (word.load(std::memory_order_acquire) == expected)
+    std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(
+        timeout, std::chrono::milliseconds{1}));
+#endif
+}
+
+inline void futex_wake_all(std::atomic<std::uint32_t> &word) noexcept {
+#ifdef __linux__
+  syscall(SYS_futex, &word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+  static_cast<void>(word);
+#endif
+}
+} // namespace sheap::detail
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+
+namespace sheap::detail {
+// Process-local record of sampled allocations, keyed by address. Sampling is
+// driven by the byte countdown of each ThreadCache; only the sampled objects
+// reach this class, under its lock.
+class Profiler {
+public:
+  static constexpr int MAX_FRAMES = 32;
+  // Taken when profiling is off, so that threads notice a later start().
+  static constexpr std::int64_t RECHECK_DISTANCE = 1 << 20;
+
+  void start(std::size_t sample_period) noexcept {
+    m_sample_period.store(sample_period, std::memory_order_relaxed);
+  }
+  void stop() noexcept { m_sample_period.store(0, std::memory_order_relaxed); }
+  [[nodiscard]] bool is_enabled() const noexcept {
+    return m_sample_period.load(std::memory_order_relaxed) != 0;
+  }
+
+  // Bytes until the next sample, drawn from an exponential distribution so
+  // that every byte is equally likely to be sampled.
+  [[nodiscard]] std::int64_t next_sample_distance() noexcept;
+
+  void record_alloc(void *ptr, std::size_t size) noexcept;
+  void record_free(void *ptr) noexcept;
+
+  // Writes the live samples and the allocations sampled so far, per call
+  // stack, in the legacy text format of pprof ("heap_v2").
+  void dump(std::ostream &os) const;
+
+  // Makes the calling thread attribute its samples to `tag` instead of
+  // unwinding its stack; nullptr restores unwinding.
+  static void set_tag(const void *tag) noexcept;
+
+  // For Sheap::lock_for_fork().
+  [[nodiscard]] std::mutex &get_lock() const noexcept { return m_mtx; }
+
+private:
+  using stack = std::array<void *, MAX_FRAMES>;
+
+  struct site {
+    std::size_t live_objs = 0;
+    std::size_t live_bytes = 0;
+    std::size_t alloc_objs = 0;
+    std::size_t alloc_bytes = 0;
+  };
+  struct sample {
+    std::size_t size;
+    site *where;
+  };
+
+  std::atomic<std::size_t> m_sample_period = 0;
+  mutable std::mutex m_mtx;
+  std::map<stack, site> m_sites;
+  std::unordered_map<void *, sample> m_live;
+};
+} // namespace sheap::detail
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "utils.h"
+
+#include <atomic>
+#include <boost/config.hpp>
+#include <cstddef>
+#include <cstdint>
+
+namespace sheap::detail {
+// Base pages held by the heaps of one tenant, charged when they are taken
+// from the PageAllocator and uncharged when they are given back. A hard limit
+// is never exceeded; a soft one only once the tenant has reclaimed what it
+// could.
+class alignas(CACHELINE_SIZE) Quota {
+public:
+  bool charge(std::size_t num_pages, bool over_soft_limit) noexcept {
+    auto used = m_used.fetch_add(num_pages, std::memory_order_relaxed);
+    auto limit = m_limit.load(std::memory_order_relaxed);
+
+    if (BOOST_LIKELY(used + num_pages <= limit))
+      return true;
+    if (over_soft_limit && !is_hard())
+      return true;
+
+    uncharge(num_pages);
+    return false;
+  }
+  void uncharge(std::size_t num_pages) noexcept {
+    m_used.fetch_sub(num_pages, std::memory_order_relaxed);
+  }
+
+  void set_limit(std::size_t num_pages, bool hard) noexcept {
+    m_limit.store(num_pages, std::memory_order_relaxed);
+    m_hard.store(hard, std::memory_order_relaxed);
+  }
+  [[nodiscard]] bool is_hard() const noexcept {
+    return m_hard.load(std::memory_order_relaxed);
+  }
+  [[nodiscard]] bool is_full() const noexcept {
+    return used() >= m_limit.load(std::memory_order_relaxed);
+  }
+  [[nodiscard]] std::size_t used() const noexcept {
+    return m_used.load(std::memory_order_relaxed);
+  }
+
+  // Recovery: the usage is recounted from the pages.
+  void reset_usage() noexcept { m_used = 0; }
+
+private:
+  std::atomic<std::size_t> m_used = 0;
+  std::atomic<std::size_t> m_limit = SIZE_MAX;
+  std::atomic<bool> m_hard = false;
+};
+} // namespace sheap::detail
@@ -0,0 +1,187 @@
+#pragma once
+
+#include "Page.h"
+#include "SpinLock.h"
+#include "utils.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace sheap::detail {
+// Memory added to a heap after it was created, see Sheap::add_region(). Its
+// Page array lies at its start, ahead of its pages.
+struct Region {
+  void *m_mem = nullptr;
+  std::size_t m_size = 0;
+  Page *m_pages = nullptr;
+  std::byte *m_base = nullptr;
+  std::size_t m_num_pages = 0;
+  // Base pages on the PageAllocator's free lists, guarded by its lock.
+  std::size_t m_num_free = 0;
+  // Granules mapped to the region, first and last.
+  std::uintptr_t m_first = 0;
+  std::uintptr_t m_last = 0;
+
+  [[nodiscard]] bool has_page(const Page *page) const noexcept {
+    return to_int(page) - to_int(m_pages) < m_num_pages * sizeof(Page);
+  }
+  [[nodiscard]] bool is_empty() const noexcept {
+    return m_num_free == m_num_pages;
+  }
+};
+
+// Finds the region of an address in two table lookups, with no lock. The
+// address space is cut into granules of 2^GRANULE_SHIFT bytes, each mapped to
+// the one region that has it through a root table of leaves. Regions never
+// share a granule: add() leaves out the ends of a region that fall into
+// granules another region has.
+class RegionMap {
+public:
+  static constexpr int MAX_REGIONS = 63;
+  static constexpr int GRANULE_SHIFT = 24;
+  static constexpr int ADDRESS_BITS = 48;
+  static constexpr int LEAF_BITS = 12;
+  static constexpr int ROOT_BITS = ADDRESS_BITS - GRANULE_SHIFT - LEAF_BITS;
+  // Each leaf covers 2^(LEAF_BITS + GRANULE_SHIFT) bytes, i.e. 64 GiB.
+  static constexpr int MAX_LEAVES = 4;
+
+  [[nodiscard]] Region *find(const void *ptr) noexcept {
+    auto granule = to_int(ptr) >> GRANULE_SHIFT;
+    if (granule >> (ROOT_BITS + LEAF_BITS))
+      return nullptr;
+
+    auto leaf = m_root[granule >> LEAF_BITS].load(std::memory_order_acquire);
+    if (leaf == 0)
+      return nullptr;
+
+    auto &entry = m_leaves[leaf - 1][granule & (pow2(LEAF_BITS) - 1)];
+    auto id = entry.load(std::memory_order_acquire);
+    return id ? &m_regions[id - 1] : nullptr;
+  }
+  [[nodiscard]] const Region *find(const void *ptr) const noexcept {
+    return const_cast<RegionMap *>(this)->find(ptr);
+  }
+
+  // Lays out [mem, mem + size) as a region of pages of `page_size` bytes and
+  // maps it. Returns nullptr if no slot or leaf is left, or if too little of
+  // it is usable.
+  Region *add(void *mem, std::size_t size, std::size_t page_size) noexcept {
+    std::lock_guard lock{m_mtx};
+    auto start = to_int(mem);
+    auto end = start + size;
+
+    if (size == 0 || (end - 1) >> ADDRESS_BITS)
+      return nullptr;
+    if (find(to_ptr(start)))
+      start = ((start >> GRANULE_SHIFT) + 1) << GRANULE_SHIFT;
+    if (find(to_ptr(end - 1)))
+      end = (end >> GRANULE_SHIFT) << GRANULE_SHIFT;
+    if (start >= end)
+      return nullptr;
+
+    auto region = find_free_slot();
+    if (region == nullptr)
+      return nullptr;
+
+    void *base = to_ptr(start);
+    std::size_t space = end - start;
+    if (!std::align(alignof(Page), sizeof(Page), base, space) ||
+        space < 2 * (page_size + sizeof(Page)))
+      return nullptr;
+
+    auto num_pages = space / (page_size + sizeof(Page)) - 1;
+    auto pages = static_cast<Page *>(base);
+    base = pages + num_pages;
+    space -= num_pages * sizeof(Page);
+    base = std::align(page_size, page_size * num_pages, base, space);
+
+    auto first = start >> GRANULE_SHIFT;
+    auto last = (end - 1) >> GRANULE_SHIFT;
+    if (!claim_leaves(first, last))
+      return nullptr;
+
+    // Every descriptor reads as free before the region can be walked.
+    for (std::size_t i = 0; i < num_pages; i++)
+      pages[i].init_free_span(1);
+
+    region->m_mem = mem;
+    region->m_size = size;
+    region->m_pages = pages;
+    region->m_base = static_cast<std::byte *>(base);
+    region->m_num_pages = num_pages;
+    region->m_first = first;
+    region->m_last = last;
+    set_granules(*region, static_cast<std::uint8_t>(region - m_regions + 1));
+    return region;
+  }
+
+  // Unmaps every region for which pred(region) is true.
+  template <typename Pred> void remove_if(Pred &&pred) noexcept {
+    std::lock_guard lock{m_mtx};
+    for (auto &region : m_regions) {
+      if (region.m_mem != nullptr && pred(region)) {
+        set_granules(region, 0);
+        region = Region{};
+      }
+    }
+  }
+
+  template <typename Fn> void for_each(Fn &&fn) noexcept {
+    for (auto &region : m_regions) {
+      if (region.m_num_pages != 0)
+        fn(region);
+    }
+  }
+
+  // Calls fn() with no region added or removed, and so unmapped, meanwhile.
+  template <typename Fn> void pin(Fn &&fn) {
+    std::lock_guard lock{m_mtx};
+    fn();
+  }
+
+  // Recovery: a region being added or removed is taken as it stands.
+  void reset() noexcept { m_mtx.reset(); }
+  // For Sheap::lock_for_fork().
+  [[nodiscard]] SpinLock &get_lock() noexcept { return m_mtx; }
+
+private:
+  Region *find_free_slot() noexcept {
+    for (auto &region : m_regions) {
+      if (region.m_mem == nullptr)
+        return &region;
+    }
+    return nullptr;
+  }
+
+  bool claim_leaves(std::uintptr_t first, std::uintptr_t last) noexcept {
+    for (auto i = first >> LEAF_BITS; i <= last >> LEAF_BITS; i++) {
+      if (m_root[i].load(std::memory_order_relaxed) != 0)
+        continue;
+      if (m_num_leaves == MAX_LEAVES)
+        return false;
+      m_root[i].store(++m_num_leaves, std::memory_order_release);
+    }
+    return true;
+  }
+
+  void set_granules(const Region &region, std::uint8_t id) noexcept {
+    for (auto g = region.m_first; g <= region.m_last; g++) {
+      auto leaf = m_root[g >> LEAF_BITS].load(std::memory_order_relaxed);
+      m_leaves[leaf - 1][g & (pow2(LEAF_BITS) - 1)].store(
+          id, std::memory_order_release);
+    }
+  }
+
+  using Leaf = std::array<std::atomic<std::uint8_t>, pow2(LEAF_BITS)>;
+
+  SpinLock m_mtx = {};
+  std::uint8_t m_num_leaves = 0;
+  std::array<std::atomic<std::uint8_t>, pow2(ROOT_BITS)> m_root = {};
+  std::array<Leaf, MAX_LEAVES> m_leaves = {};
+  Region m_regions[MAX_REGIONS] = {};
+};
+} // namespace sheap::detail
@@ -9,23 +9,45 @@ struct Bin {
   int alignment;
 };
 
+constexpr auto MinAllocSize = 16;
+constexpr auto MaxAllocSize = 4096;
+constexpr auto InternalFragmentationLimit = 0.05;
+
+// A page spans 2^page_order contiguous base pages (config::page_size).
+constexpr int NUM_PAGE_ORDERS = 15;
+constexpr auto MinObjsPerPage = 32;
+
+// Small bins get a single base page, so that a sparsely used bin pins little
+// memory. Larger bins get the shortest power of two run of base pages that
+// holds MinObjsPerPage objects, which bounds both the tail waste (below one
+// object in MinObjsPerPage) and how often a thread has to come back for more.
+static constexpr int get_page_order(Bin bin, std::size_t base_page_size) {
+  auto order = 0;
+
+  while (order + 1 < NUM_PAGE_ORDERS &&
+         (base_page_size << order) < std::size_t(bin.size) * MinObjsPerPage) {
+    order++;
+  }
+
+  return order;
+}
+
 struct SizeClass {
   int binid;
   Bin bin;
+  int page_order;
   std::size_t page_size;
   std::size_t num_objs;
 
-  constexpr SizeClass(int binid, Bin bin, std::size_t page_size)
-      : binid(binid), bin(bin), page_size(page_size),
+  constexpr SizeClass(int binid, Bin bin, std::size_t base_page_size)
+      : binid(binid), bin(bin),
+        page_order(get_page_order(bin, base_page_size)),
+        page_size(base_page_size << page_order),
         num_objs(page_size / bin.size) {}
 
   SizeClass() = default;
 };
 
-constexpr auto MinAllocSize = 16;
-constexpr auto MaxAllocSize = 4096;
-constexpr auto InternalFragmentationLimit = 0.05;
-
 static constexpr std::size_t get_num_bins() {
   auto num_bins = 0;
   auto distance = 16;
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "Trace.h"
+
 #include <atomic>
 #include <boost/interprocess/sync/spin/wait.hpp>
 #include <cinttypes>
@@ -20,19 +22,27 @@ public:
 
   void lock() noexcept {
     if (!try_lock()) {
+      SHEAP_PROBE(lock_contended, this);
       boost::interprocess::spin_wait swait;
+      [[maybe_unused]] unsigned num_spins = 0;
       do {
         if (try_lock()) {
           break;
         } else {
           swait.yield();
+          num_spins++;
         }
       } while (true);
+      SHEAP_PROBE(lock_acquired, this, num_spins);
     }
   }
 
   void unlock() noexcept { m_state = UNLOCKED; }
 
+  // For recovery only: the holder may have died with the lock held.
+  [[nodiscard]] bool is_locked() const noexcept { return m_state == LOCKED; }
+  void reset() noexcept { m_state = UNLOCKED; }
+
 private:
   enum { UNLOCKED, LOCKED };
   std::atomic<std::int8_t> m_state = UNLOCKED;
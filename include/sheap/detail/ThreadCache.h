@@ -1,25 +1,211 @@
 #pragma once
 
 #include "Page.h"
+#include "Trace.h"
+#include "TransferCache.h"
+
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
 
 namespace sheap::detail {
 class ThreadCache {
 public:
-  ThreadCache() : m_active(Page::get_null_page()) {}
+  explicit ThreadCache(Page *null_page) noexcept
+      : m_active(null_page), m_null(null_page) {
+    BOOST_ASSERT(null_page->is_null());
+  }
 
+  // Freed objects are reused before new pages are taken: first the thread's
+  // own, then a batch from `transfer`. Aligned allocations must come from
+  // the active page, which records them.
   template <bool IsAlignedAlloc, typename PageAlloc, typename PageFree>
-  void *alloc(PageAlloc &&page_alloc, PageFree &&page_free) noexcept {
+  void *alloc(TransferCache &transfer, PageAlloc &&page_alloc,
+              PageFree &&page_free) noexcept {
     if (auto mem = alloc_fast<IsAlignedAlloc>())
       return mem;
 
+    if constexpr (!IsAlignedAlloc) {
+      if (auto mem = pop_obj())
+        return mem;
+    }
+
     if (auto mem = alloc_slow<IsAlignedAlloc>())
       return mem;
 
+    if constexpr (!IsAlignedAlloc) {
+      if (auto batch = transfer.remove()) {
+        set_objs(batch, TransferCache::BATCH_SIZE);
+        return pop_obj();
+      }
+    }
+
     return alloc_very_slow<IsAlignedAlloc>(page_alloc, page_free);
   }
 
-private:
-  template <bool IsAlignedAlloc> void *alloc_fast() {
+  // Like alloc(), but never waits: a busy transfer cache is skipped, and
+  // neither try_page_alloc() nor try_page_free() may wait. Full pages that
+  // try_page_free() could not take stay with the thread until later.
+  template <typename TryPageAlloc, typename TryPageFree>
+  void *try_alloc(TransferCache &transfer, TryPageAlloc &&try_page_alloc,
+                  TryPageFree &&try_page_free, bool &contended) noexcept {
+    if (auto mem = alloc_fast<false>())
+      return mem;
+    if (auto mem = pop_obj())
+      return mem;
+    if (auto mem = alloc_slow<false>())
+      return mem;
+
+    if (auto batch = transfer.try_remove(contended)) {
+      set_objs(batch, TransferCache::BATCH_SIZE);
+      return pop_obj();
+    }
+
+    if (!m_used_pages.empty())
+      try_page_free(m_used_pages);
+
+    m_rem_pages = try_page_alloc();
+    return alloc_slow<false>();
+  }
+
+  // Allocates from whichever page the thread holds with room that lies
+  // closest to `near`, e.g. the page of an object the new one is used with.
+  // Kept objects are not used, as they could be anywhere.
+  void *alloc_near(const Page *near) noexcept {
+    auto dist = [&](const Page *page) {
+      auto a = to_int(page), b = to_int(near);
+      return a > b ? a - b : b - a;
+    };
+    auto best_dist = m_active->is_full() ? UINTPTR_MAX : dist(m_active);
+    auto best_prev = m_rem_pages.before_begin();
+    bool found = false;
+
+    for (auto prev = m_rem_pages.before_begin();
+         std::next(prev) != m_rem_pages.end(); prev++) {
+      if (auto d = dist(&*std::next(prev)); d < best_dist) {
+        best_dist = d;
+        best_prev = prev;
+        found = true;
+      }
+    }
+
+    if (!found)
+      return alloc_fast<false>();
+
+    // Pages waiting to become active must have room.
+    auto &page = *std::next(best_prev);
+    auto mem = page.alloc();
+    if (page.is_full()) {
+      m_rem_pages.erase_after(best_prev);
+      m_used_pages.push_front(page);
+    }
+    return mem;
+  }
+
+  // Keeps `obj` for reuse. Returns a batch for the transfer cache once twice
+  // a batch has piled up, so the thread keeps one for itself.
+  [[nodiscard]] object *free(object *obj) noexcept {
+    obj->set_next(m_objs);
+    if (m_num_objs + 1 < 2 * TransferCache::BATCH_SIZE) {
+      set_objs(obj, m_num_objs + 1);
+      return nullptr;
+    }
+
+    auto batch = obj;
+    auto last = batch;
+    for (int i = 1; i < TransferCache::BATCH_SIZE; i++)
+      last = last->get_next();
+
+    set_objs(last->get_next(), m_num_objs + 1 - TransferCache::BATCH_SIZE);
+    last->set_next(nullptr);
+    return batch;
+  }
+
+  // Takes pages until `count` objects can be allocated without a lock, or no
+  // more pages can be had, and makes sure the active page has room.
+  // prefault(page) is called for every page taken.
+  template <typename PageAlloc, typename Prefault>
+  void reserve(std::size_t count, PageAlloc &&page_alloc,
+               Prefault &&prefault) noexcept {
+    for (auto num_free = available(); num_free < count;) {
+      auto pages = page_alloc();
+      if (pages.empty())
+        break;
+
+      for (auto &page : pages) {
+        prefault(page);
+        num_free += page.num_free();
+      }
+      m_rem_pages.splice_after(m_rem_pages.before_begin(), pages);
+    }
+
+    if (m_active->is_full())
+      next_page();
+  }
+
+  // Objects that can be allocated without taking a lock.
+  [[nodiscard]] std::size_t available() const noexcept {
+    auto num_free = m_active->num_free() + m_num_objs;
+    for (auto &page : m_rem_pages)
+      num_free += page.num_free();
+    return num_free;
+  }
+
+  template <typename Fn> void for_each_obj(Fn &&fn) noexcept {
+    for (auto obj = m_objs; obj; obj = obj->get_next())
+      fn(static_cast<void *>(obj));
+  }
+
+  // Like for_each_obj(), appending to `out`, while the thread may be using
+  // the cache. The list is read again until it was not changed meanwhile;
+  // valid(obj) must tell whether a link read in the middle of a change may
+  // be followed.
+  template <typename Valid>
+  void copy_objs(std::vector<void *> &out, Valid &&valid) const {
+    auto size = out.size();
+    while (true) {
+      auto seq = m_objs_seq.load(std::memory_order_acquire);
+      if ((seq & 1) == 0) {
+        auto obj = racy_load(&m_objs);
+        auto num_objs = racy_load(&m_num_objs);
+        for (int i = 0; i < num_objs && obj && valid(obj); i++) {
+          out.push_back(obj);
+          obj = obj->racy_next();
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_objs_seq.load(std::memory_order_relaxed) == seq)
+          return;
+      }
+
+      out.resize(size);
+      BOOST_INTERPROCESS_SMT_PAUSE;
+    }
+  }
+
+  // Gives up every kept object, as a list.
+  [[nodiscard]] object *flush() noexcept {
+    auto objs = m_objs;
+    set_objs(nullptr, 0);
+    return objs;
+  }
+
+  // Gives up every page, however full, as a list.
+  [[nodiscard]] FreePageList flush_pages() noexcept {
+    FreePageList pages;
+    pages.splice_after(pages.before_begin(), m_rem_pages);
+    pages.splice_after(pages.before_begin(), m_used_pages);
+
+    if (!m_active->is_null()) {
+      pages.push_front(*m_active);
+      m_active = m_null;
+    }
+    return pages;
+  }
+
+  template <bool IsAlignedAlloc> void *alloc_fast() noexcept {
     if (auto mem = m_active->alloc(); BOOST_LIKELY(mem != nullptr)) {
       if constexpr (IsAlignedAlloc) {
         m_active->set_has_aligned();
@@ -30,24 +216,65 @@ private:
     return nullptr;
   }
 
+  [[nodiscard]] bool is_next_zeroed() const noexcept {
+    return m_active->is_next_zeroed();
+  }
+
+#ifdef SHEAP_ENABLE_PROFILER
+  // Counts down the bytes allocated until the next sample, so that the fast
+  // path pays only a subtraction for profiling.
+  bool sample(std::size_t size) noexcept {
+    m_bytes_until_sample -= static_cast<std::int64_t>(size);
+    return m_bytes_until_sample < 0;
+  }
+  void set_sample_distance(std::int64_t bytes) noexcept {
+    m_bytes_until_sample = bytes;
+  }
+#endif
+
+private:
+  void *pop_obj() noexcept {
+    if (m_num_objs == 0)
+      return nullptr;
+
+    auto obj = m_objs;
+    set_objs(obj->get_next(), m_num_objs - 1);
+    return obj;
+  }
+
+  // Odd while the list is being changed, for copy_objs().
+  void set_objs(object *objs, int num_objs) noexcept {
+    auto seq = m_objs_seq.load(std::memory_order_relaxed);
+    m_objs_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_objs = objs;
+    m_num_objs = num_objs;
+    m_objs_seq.store(seq + 2, std::memory_order_release);
+  }
+
   template <bool IsAlignedAlloc> void *alloc_slow() {
+    SHEAP_PROBE(alloc_slow, this);
+    next_page();
+    return alloc_fast<IsAlignedAlloc>();
+  }
+
+  void next_page() noexcept {
     if (BOOST_LIKELY(!m_active->is_null())) {
       m_used_pages.push_front(*m_active);
-      m_active = Page::get_null_page();
+      m_active = m_null;
     }
 
     if (BOOST_LIKELY(!m_rem_pages.empty())) {
       m_active = &m_rem_pages.front();
       m_rem_pages.pop_front();
     }
-
-    return alloc_fast<IsAlignedAlloc>();
   }
 
   template <bool IsAlignedAlloc, typename PageAlloc, typename PageFree>
   void *alloc_very_slow(PageAlloc &&page_alloc, PageFree &&page_free) {
     BOOST_ASSERT(m_active->is_null());
     BOOST_ASSERT(m_rem_pages.empty());
+    SHEAP_PROBE(alloc_very_slow, this);
 
     if (!m_used_pages.empty())
       page_free(m_used_pages);
@@ -57,7 +284,14 @@ private:
   }
 
   Page *m_active = nullptr;
+  Page *m_null = nullptr;
   FreePageList m_rem_pages = {};
   FreePageList m_used_pages = {};
+  object *m_objs = nullptr;
+  int m_num_objs = 0;
+  std::atomic<std::uint32_t> m_objs_seq = 0;
+#ifdef SHEAP_ENABLE_PROFILER
+  std::int64_t m_bytes_until_sample = 0;
+#endif
 };
 } // namespace sheap::detail
\ No newline at end of file
@@ -0,0 +1,19 @@
+#pragma once
+
+// Probes on the allocator's slow paths, to line them up with latency spikes.
+// Configured with -DSHEAP_ENABLE_USDT=ON they are USDT (SystemTap SDT)
+// probes of provider `sheap`, a single nop each until a tracer attaches:
+//
+//   bpftrace -e 'usdt:libsheap.so:sheap:lock_contended { @[ustack]++; }'
+//   perf buildid-cache --add libsheap.so; perf record -e 'sdt_sheap:*'
+//
+// A build may define SHEAP_PROBE(name, args...) itself to route them
+// elsewhere. Otherwise they compile to nothing, arguments included.
+#ifndef SHEAP_PROBE
+#ifdef SHEAP_ENABLE_USDT
+#include <sys/sdt.h>
+#define SHEAP_PROBE(name, ...) STAP_PROBEV(sheap, name, __VA_ARGS__)
+#else
+#define SHEAP_PROBE(name, ...) static_cast<void>(0)
+#endif
+#endif
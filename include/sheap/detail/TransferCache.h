@@ -0,0 +1,70 @@
+#pragma once
+
+#include "Context.h"
+#include "SpinLock.h"
+
+#include <array>
+#include <mutex>
+
+namespace sheap::detail {
+// Free objects of one bin, passed between thread caches in batches of
+// BATCH_SIZE linked objects, so that objects freed by one thread are reused
+// by another for one lock per batch instead of going back to their pages.
+class alignas(CACHELINE_SIZE) TransferCache {
+public:
+  static constexpr int BATCH_SIZE = 32;
+  static constexpr int NUM_BATCHES = 64;
+
+  // Fails when full, leaving `batch` to the caller.
+  bool insert(object *batch) noexcept {
+    std::lock_guard lock{m_mtx};
+    if (m_num_batches == NUM_BATCHES)
+      return false;
+
+    m_batches[m_num_batches++] = batch;
+    return true;
+  }
+
+  object *remove() noexcept {
+    std::lock_guard lock{m_mtx};
+    if (m_num_batches == 0)
+      return nullptr;
+
+    return m_batches[--m_num_batches];
+  }
+
+  // Fails rather than wait for the lock, setting `contended`.
+  object *try_remove(bool &contended) noexcept {
+    std::unique_lock lock{m_mtx, std::try_to_lock};
+    if (!lock) {
+      contended = true;
+      return nullptr;
+    }
+    if (m_num_batches == 0)
+      return nullptr;
+
+    return m_batches[--m_num_batches];
+  }
+
+  // Without the lock, so only a hint.
+  [[nodiscard]] bool is_empty() const noexcept {
+    return racy_load(&m_num_batches) == 0;
+  }
+
+  // Only for a heap nobody is using.
+  template <typename Fn> void for_each_batch(Fn &&fn) noexcept {
+    for (int i = 0; i < m_num_batches; i++)
+      fn(m_batches[i]);
+  }
+
+  // Recovery: whether the batches can be trusted.
+  [[nodiscard]] bool is_locked() const noexcept { return m_mtx.is_locked(); }
+  // For Sheap::lock_for_fork().
+  [[nodiscard]] SpinLock &get_lock() noexcept { return m_mtx; }
+
+private:
+  SpinLock m_mtx = {};
+  int m_num_batches = 0;
+  std::array<object *, NUM_BATCHES> m_batches = {};
+};
+} // namespace sheap::detail
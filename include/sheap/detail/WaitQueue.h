@@ -0,0 +1,149 @@
+#pragma once
+
+#include "Process.h"
+#include "utils.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace sheap::detail {
+// Allocations waiting for pages to come back, served in the order they
+// arrived: only the oldest one retries, and it is woken whenever pages are
+// freed. Waiters sleep on a futex in the heap, so the processes sharing it
+// wake each other. Each waiter holds a ticket; one that times out cancels
+// its ticket, and whoever passes the head of the queue skips cancelled
+// tickets. The ticket at the head is cancelled on behalf of its process if
+// that died.
+class alignas(CACHELINE_SIZE) WaitQueue {
+public:
+  // Waiters there can be at a time.
+  static constexpr std::uint32_t MAX_WAITERS = 1024;
+  // Frees of single objects wake nobody, so the head of the queue retries
+  // this often anyway, and the others check on it.
+  static constexpr std::chrono::milliseconds HEAD_POLL{1};
+  static constexpr std::chrono::milliseconds POLL{100};
+
+  [[nodiscard]] bool has_waiters() const noexcept {
+    return m_num_waiters.load(std::memory_order_relaxed) != 0;
+  }
+
+  // After pages were freed.
+  void notify() noexcept {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (has_waiters())
+      wake_all();
+  }
+
+  // Calls try_alloc() until it succeeds or `deadline` passes, once the
+  // waiters that came earlier are done. Returns nullptr at once if there are
+  // already MAX_WAITERS of them.
+  template <typename TryAlloc>
+  void *wait(TryAlloc &&try_alloc,
+             std::chrono::steady_clock::time_point deadline) noexcept {
+    m_num_waiters.fetch_add(1, std::memory_order_seq_cst);
+    std::uint32_t ticket;
+    if (!take_ticket(ticket)) {
+      m_num_waiters.fetch_sub(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    auto pid = static_cast<std::uint32_t>(current_pid());
+    m_tickets[ticket % MAX_WAITERS].m_owner.store(
+        std::uint64_t{ticket} << 32 | pid, std::memory_order_release);
+
+    void *mem = nullptr;
+    while (true) {
+      auto seq = m_seq.load(std::memory_order_seq_cst);
+      auto head = m_serving.load(std::memory_order_seq_cst);
+
+      if (head == ticket && (mem = try_alloc()) != nullptr)
+        break;
+
+      auto now = std::chrono::steady_clock::now();
+      if (now >= deadline)
+        break;
+
+      futex_wait(m_seq, seq,
+                 std::min<std::chrono::nanoseconds>(
+                     deadline - now, head == ticket ? HEAD_POLL : POLL));
+      if (head != ticket && m_seq.load(std::memory_order_relaxed) == seq)
+        skip_if_dead(head);
+    }
+
+    if (mem != nullptr) {
+      pass(ticket);
+    } else {
+      cancel(ticket);
+    }
+    m_num_waiters.fetch_sub(1, std::memory_order_relaxed);
+    return mem;
+  }
+
+  // Recovery: nobody waits any more.
+  void reset() noexcept {
+    m_serving = m_next_ticket.load();
+    m_num_waiters = 0;
+  }
+
+private:
+  struct Ticket {
+    // The ticket and pid of its holder, and one past the ticket once it is
+    // cancelled. Both only ever match the ticket they were written for.
+    std::atomic<std::uint64_t> m_owner = 0;
+    std::atomic<std::uint32_t> m_cancelled = 0;
+  };
+
+  // Tickets wrap around m_tickets, so one is only handed out while fewer
+  // than MAX_WAITERS are ahead of it.
+  bool take_ticket(std::uint32_t &ticket) noexcept {
+    ticket = m_next_ticket.load(std::memory_order_seq_cst);
+    do {
+      if (ticket - m_serving.load(std::memory_order_seq_cst) >= MAX_WAITERS)
+        return false;
+    } while (!m_next_ticket.compare_exchange_weak(ticket, ticket + 1,
+                                                  std::memory_order_seq_cst));
+    return true;
+  }
+
+  // Moves the head past `ticket`, and past the cancelled tickets behind it.
+  // Whoever moves it past a ticket goes on with the next one, so that racing
+  // cancellations skip each ticket exactly once.
+  void pass(std::uint32_t ticket) noexcept {
+    while (m_serving.compare_exchange_strong(ticket, ticket + 1,
+                                             std::memory_order_seq_cst)) {
+      ticket++;
+      auto &next = m_tickets[ticket % MAX_WAITERS];
+      if (next.m_cancelled.load(std::memory_order_seq_cst) != ticket + 1)
+        break;
+    }
+    wake_all();
+  }
+
+  void cancel(std::uint32_t ticket) noexcept {
+    m_tickets[ticket % MAX_WAITERS].m_cancelled.store(
+        ticket + 1, std::memory_order_seq_cst);
+    pass(ticket);
+  }
+
+  void skip_if_dead(std::uint32_t head) noexcept {
+    auto owner = m_tickets[head % MAX_WAITERS].m_owner.load(
+        std::memory_order_acquire);
+    if (owner >> 32 == head && !is_alive(static_cast<int>(owner)))
+      cancel(head);
+  }
+
+  void wake_all() noexcept {
+    m_seq.fetch_add(1, std::memory_order_seq_cst);
+    futex_wake_all(m_seq);
+  }
+
+  // Bumped by every wake-up; the futex word.
+  std::atomic<std::uint32_t> m_seq = 0;
+  std::atomic<std::uint32_t> m_num_waiters = 0;
+  std::atomic<std::uint32_t> m_next_ticket = 0;
+  std::atomic<std::uint32_t> m_serving = 0;
+  alignas(CACHELINE_SIZE) std::array<Ticket, MAX_WAITERS> m_tickets = {};
+};
+} // namespace sheap::detail
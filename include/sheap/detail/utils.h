@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <new>
 #include <type_traits>
+#include <utility>
 
 #if __has_include(<sanitizer/asan_interface.h>)
 #include <sanitizer/asan_interface.h>
@@ -13,6 +14,13 @@
 #endif
 
 namespace sheap::detail {
+// Unit of coherence traffic. Independently written words are kept this far
+// apart so that writers on different cores never invalidate each other.
+constexpr std::size_t CACHELINE_SIZE = 64;
+// Smallest page the OS maps memory in; touching one byte of each faults in a
+// whole range.
+constexpr std::size_t OS_PAGE_SIZE = 4096;
+
 static constexpr int log2(std::size_t n) {
   int lg2 = 0;
   while (n >>= 1) {
@@ -24,6 +32,18 @@ static constexpr int log2(std::size_t n) {
 static constexpr bool is_pow2(std::size_t n) { return !(n & (n - 1)); }
 static constexpr std::size_t pow2(int n) { return UINT64_C(1) << n; }
 
+// `n` must not be zero.
+inline int count_trailing_zeros(std::uint64_t n) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(n);
+#else
+  int tz = 0;
+  for (; !(n & 1); n >>= 1)
+    tz++;
+  return tz;
+#endif
+}
+
 static constexpr int next_pow_2(std::size_t n) {
   if (n <= 1) {
     return 1;
@@ -53,6 +73,24 @@ template <typename Ptr = void *> Ptr to_ptr(std::uintptr_t p) noexcept {
   return reinterpret_cast<Ptr>(p);
 }
 
+// Reads a word another thread may be writing with plain stores, for readers
+// that check afterwards whether it changed. Not checked by ASan, as the word
+// may lie in a free object that is poisoned, or being unpoisoned meanwhile.
+template <typename T>
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((no_sanitize_address))
+#endif
+T racy_load(const T *ptr) noexcept {
+  static_assert(std::is_trivially_copyable_v<T> && sizeof(T) <= 8);
+#if defined(__GNUC__) || defined(__clang__)
+  std::remove_const_t<T> val;
+  __atomic_load(ptr, &val, __ATOMIC_RELAXED);
+  return val;
+#else
+  return *static_cast<const volatile T *>(ptr);
+#endif
+}
+
 inline void asan_poison_memory_region(void const volatile *addr, size_t size) {
 #ifdef ASAN_ENABLED
   if (addr)
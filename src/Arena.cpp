@@ -0,0 +1,73 @@
+#include "sheap/Arena.h"
+
+#include <algorithm>
+
+namespace sheap {
+void *arena::alloc_slow(std::size_t size, std::size_t align) noexcept {
+  auto page_size = m_sheap->get_page_size();
+  // Runs only start on a base page boundary.
+  auto need = std::max<std::size_t>(size, 1) +
+              (align > page_size ? align - page_size : 0);
+  auto num_pages = (need - 1) / page_size + 1;
+
+  if (need < size || num_pages > detail::pow2(detail::NUM_PAGE_ORDERS - 1))
+    return nullptr;
+
+  auto order = detail::log2(detail::next_pow_2(num_pages));
+  auto page = m_sheap->alloc_arena_page(m_tenant, m_tid, order);
+  if (page == nullptr)
+    return nullptr;
+
+  auto base = static_cast<std::byte *>(m_sheap->get_page_ptr(page));
+  auto end = base + (page_size << order);
+  auto mem =
+      static_cast<std::byte *>(boost::alignment::align_up(base, align));
+  m_pages.push_front(*page);
+
+  // Carry on with whichever page has more room left. rewind() only relies on
+  // the order of the pages, not on which one is current.
+  if (end - (mem + size) >= m_end - m_cur) {
+    m_cur = mem + size;
+    m_end = end;
+  }
+
+  detail::asan_unpoison_memory_region(mem, size);
+  return mem;
+}
+
+void arena::rewind(const savepoint &sp) noexcept {
+  detail::FreePageList pages;
+
+  while (!m_pages.empty() && &m_pages.front() != sp.page) {
+    auto &page = m_pages.front();
+    m_pages.pop_front();
+    pages.push_front(page);
+  }
+  BOOST_ASSERT(sp.page == nullptr || !m_pages.empty());
+
+  if (!pages.empty())
+    m_sheap->free_arena_pages(m_tenant, m_tid, pages);
+  if (sp.cur != nullptr)
+    detail::asan_poison_memory_region(sp.cur, sp.end - sp.cur);
+
+  m_cur = sp.cur;
+  m_end = sp.end;
+}
+
+void arena::reset() noexcept {
+  if (m_pages.empty())
+    return;
+
+  auto &first = m_pages.back();
+  auto base = static_cast<std::byte *>(m_sheap->get_page_ptr(&first));
+  rewind({&first, base,
+          base + first.num_base_pages() * m_sheap->get_page_size()});
+}
+
+std::size_t arena::capacity() const noexcept {
+  std::size_t num_pages = 0;
+  for (auto &page : m_pages)
+    num_pages += page.num_base_pages();
+  return num_pages * m_sheap->get_page_size();
+}
+} // namespace sheap
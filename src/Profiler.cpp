@@ -0,0 +1,122 @@
+#include "sheap/detail/Profiler.h"
+
+#include <algorithm>
+#include <fstream>
+#include <random>
+
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define SHEAP_HAVE_BACKTRACE
+#endif
+
+namespace sheap::detail {
+static thread_local const void *t_tag = nullptr;
+// Set while the profiler itself runs, as its containers may allocate from the
+// very heap being profiled when it replaces malloc.
+static thread_local bool t_in_profiler = false;
+
+namespace {
+struct reentry_guard {
+  reentry_guard() noexcept { t_in_profiler = true; }
+  ~reentry_guard() { t_in_profiler = false; }
+};
+} // namespace
+
+std::int64_t Profiler::next_sample_distance() noexcept {
+  static thread_local std::mt19937_64 gen{std::random_device{}()};
+  auto period = m_sample_period.load(std::memory_order_relaxed);
+
+  if (period == 0)
+    return RECHECK_DISTANCE;
+
+  std::exponential_distribution<double> dist{1.0 / period};
+  return static_cast<std::int64_t>(dist(gen)) + 1;
+}
+
+void Profiler::record_alloc(void *ptr, std::size_t size) noexcept {
+  if (t_in_profiler || !is_enabled())
+    return;
+
+  reentry_guard guard;
+  stack frames = {};
+
+  if (t_tag != nullptr) {
+    frames[0] = const_cast<void *>(t_tag);
+  } else {
+#ifdef SHEAP_HAVE_BACKTRACE
+    // Skip this frame and Sheap::alloc_sampled().
+    std::array<void *, MAX_FRAMES + 2> trace;
+    auto depth = std::max(backtrace(trace.data(), trace.size()), 2) - 2;
+    std::copy_n(trace.begin() + 2, depth, frames.begin());
+#endif
+  }
+
+  try {
+    std::lock_guard lock{m_mtx};
+    auto &where = m_sites[frames];
+
+    where.live_objs++;
+    where.live_bytes += size;
+    where.alloc_objs++;
+    where.alloc_bytes += size;
+    m_live[ptr] = {size, &where};
+  } catch (...) {
+    // Out of memory for the profile itself: the sample is dropped.
+  }
+}
+
+void Profiler::record_free(void *ptr) noexcept {
+  if (t_in_profiler)
+    return;
+
+  reentry_guard guard;
+  std::lock_guard lock{m_mtx};
+
+  if (auto it = m_live.find(ptr); it != m_live.end()) {
+    it->second.where->live_objs--;
+    it->second.where->live_bytes -= it->second.size;
+    m_live.erase(it);
+  }
+}
+
+void Profiler::dump(std::ostream &os) const {
+  reentry_guard guard;
+  std::lock_guard lock{m_mtx};
+  site total;
+
+  for (auto &[frames, where] : m_sites) {
+    total.live_objs += where.live_objs;
+    total.live_bytes += where.live_bytes;
+    total.alloc_objs += where.alloc_objs;
+    total.alloc_bytes += where.alloc_bytes;
+  }
+
+  auto print = [&](const site &s) {
+    os << s.live_objs << ": " << s.live_bytes << " [" << s.alloc_objs << ": "
+       << s.alloc_bytes << "] @";
+  };
+
+  os << "heap profile: ";
+  print(total);
+  os << " heap_v2/" << m_sample_period.load(std::memory_order_relaxed)
+     << '\n';
+
+  for (auto &[frames, where] : m_sites) {
+    os << ' ';
+    print(where);
+    for (auto frame : frames) {
+      if (frame == nullptr)
+        break;
+      os << ' ' << frame;
+    }
+    os << '\n';
+  }
+
+  // Lets pprof symbolize the addresses.
+  if (std::ifstream maps{"/proc/self/maps"}) {
+    os << "\nMAPPED_LIBRARIES:\n" << maps.rdbuf();
+  }
+}
+
+void Profiler::set_tag(const void *tag) noexcept { t_tag = tag; }
+} // namespace sheap::detail
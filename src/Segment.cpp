@@ -0,0 +1,210 @@
+#include "sheap/Segment.h"
+
+#include <boost/align/align_up.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+namespace sheap {
+namespace {
+// Kept in the first bytes of the segment, ahead of the heap.
+struct header {
+  static constexpr std::uint64_t MAGIC = 0x5345474D454E5401;
+
+  std::uint64_t magic;
+  void *address;
+  std::size_t size;
+};
+
+constexpr std::size_t HEADER_SIZE = 4096;
+
+[[noreturn]] void throw_errno(const char *what) {
+  throw std::system_error{errno, std::generic_category(), what};
+}
+
+std::string shm_name(const std::string &name) {
+  return name.front() == '/' ? name : "/" + name;
+}
+
+int map_flags(const segment_options &opts) {
+  auto flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if (opts.populate || opts.lock)
+    flags |= MAP_POPULATE;
+#endif
+  return flags;
+}
+
+// Maps `fd` at `addr`, which must be free, or anywhere if it is null.
+void *map(int fd, std::size_t size, void *addr, const segment_options &opts) {
+  auto flags = map_flags(opts);
+#ifdef MAP_FIXED_NOREPLACE
+  if (addr != nullptr)
+    flags |= MAP_FIXED_NOREPLACE;
+#endif
+
+  auto base = mmap(addr, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+  if (base == MAP_FAILED)
+    throw_errno("sheap: mmap");
+
+  // Older kernels take the address as a mere hint.
+  if (addr != nullptr && base != addr) {
+    munmap(base, size);
+    errno = EEXIST;
+    throw_errno("sheap: segment address is taken");
+  }
+
+#ifdef MADV_HUGEPAGE
+  if (opts.huge_pages && !opts.memfd)
+    madvise(base, size, MADV_HUGEPAGE);
+#endif
+
+  if (opts.lock && mlock(base, size) != 0) {
+    auto err = errno;
+    munmap(base, size);
+    errno = err;
+    throw_errno("sheap: mlock");
+  }
+
+  return base;
+}
+
+// Closes the descriptor unless released, so that every throw cleans up.
+struct fd_guard {
+  int fd;
+  ~fd_guard() {
+    if (fd >= 0)
+      close(fd);
+  }
+  int release() noexcept { return std::exchange(fd, -1); }
+};
+
+// Unmaps the mapping unless released.
+struct map_guard {
+  void *base;
+  std::size_t size;
+  ~map_guard() {
+    if (base != nullptr)
+      munmap(base, size);
+  }
+  void *release() noexcept { return std::exchange(base, nullptr); }
+};
+
+// Unlinks a segment just created unless released, so that a failed create
+// leaves no name behind.
+struct name_guard {
+  const std::string *name;
+  ~name_guard() {
+    if (name != nullptr)
+      segment::remove(*name);
+  }
+  void release() noexcept { name = nullptr; }
+};
+} // namespace
+
+segment segment::create(const std::string &name, std::size_t size,
+                        const config &c, const segment_options &opts) {
+  int fd = -1;
+
+  if (opts.memfd) {
+#ifdef __linux__
+    unsigned flags = 0;
+    if (opts.huge_pages)
+      flags |= MFD_HUGETLB;
+    fd = memfd_create(name.c_str(), flags);
+#else
+    errno = ENOTSUP;
+#endif
+  } else {
+    fd = shm_open(shm_name(name).c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  }
+
+  if (fd < 0)
+    throw_errno("sheap: cannot create segment");
+  fd_guard guard{fd};
+  name_guard unlink{opts.memfd ? nullptr : &name};
+
+  if (opts.huge_pages)
+    size = boost::alignment::align_up(size, HUGE_PAGE_SIZE);
+
+  if (ftruncate(fd, size) != 0)
+    throw_errno("sheap: ftruncate");
+
+  auto base = map(fd, size, nullptr, opts);
+  map_guard mapping{base, size};
+  auto hdr = static_cast<header *>(base);
+  // The segment is fresh, hence zero.
+  auto heap_config =
+      config{c.max_threads, c.page_size, c.num_heaps, c.max_tenants,
+             opts.huge_pages ? HUGE_PAGE_SIZE : c.page_array_align, true};
+  auto heap = Sheap{static_cast<char *>(base) + HEADER_SIZE,
+                    size - HEADER_SIZE, heap_config};
+
+  hdr->address = base;
+  hdr->size = size;
+  std::atomic_thread_fence(std::memory_order_release);
+  hdr->magic = header::MAGIC;
+
+  unlink.release();
+  return segment{guard.release(), mapping.release(), size, std::move(heap)};
+}
+
+segment segment::open(const std::string &name, const segment_options &opts) {
+  auto fd = shm_open(shm_name(name).c_str(), O_RDWR, 0);
+
+  if (fd < 0)
+    throw_errno("sheap: cannot open segment");
+  return attach(fd, opts);
+}
+
+segment segment::open(int fd, const segment_options &opts) {
+  auto dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+  if (dup_fd < 0)
+    throw_errno("sheap: cannot open segment");
+  return attach(dup_fd, opts);
+}
+
+segment segment::attach(int fd, const segment_options &opts) {
+  fd_guard guard{fd};
+  header hdr;
+
+  if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+    throw_errno("sheap: cannot read segment header");
+
+  if (hdr.magic != header::MAGIC) {
+    errno = EINVAL;
+    throw_errno("sheap: not a segment");
+  }
+
+  auto base = map(fd, hdr.size, hdr.address, opts);
+  map_guard mapping{base, hdr.size};
+  auto heap = Sheap{static_cast<char *>(base) + HEADER_SIZE,
+                    hdr.size - HEADER_SIZE, open_existing};
+  return segment{guard.release(), mapping.release(), hdr.size,
+                 std::move(heap)};
+}
+
+void segment::remove(const std::string &name) noexcept {
+  shm_unlink(shm_name(name).c_str());
+}
+
+segment::segment(segment &&o) noexcept
+    : m_fd(std::exchange(o.m_fd, -1)), m_base(std::exchange(o.m_base, nullptr)),
+      m_size(o.m_size), m_heap(std::move(o.m_heap)) {}
+
+segment::~segment() {
+  if (m_base != nullptr) {
+    m_heap.close();
+    munmap(m_base, m_size);
+  }
+
+  if (m_fd >= 0)
+    close(m_fd);
+}
+} // namespace sheap
@@ -1,31 +1,240 @@
 #include "sheap/Sheap.h"
+#include "sheap/detail/Directory.h"
+#include "sheap/detail/Epoch.h"
+#include "sheap/detail/HandleTable.h"
 #include "sheap/detail/Heap.h"
+#include "sheap/detail/Quota.h"
+#include "sheap/detail/SpinLock.h"
 #include "sheap/detail/ThreadCache.h"
+#include "sheap/detail/TransferCache.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <memory>
+#include <stdexcept>
 #include <utility>
+#include <vector>
 
 namespace sheap {
 using namespace detail;
+
+// Identifies a heap and the layout of everything in it, so that a heap is
+// only reopened by code that agrees on that layout.
+static constexpr std::uint64_t MAGIC = 0x5348454150000003;
+static constexpr std::uint64_t LAYOUT = sizeof(Page) | sizeof(Heap) << 8 |
+                                        sizeof(ThreadCache) << 24 |
+                                        std::uint64_t{NUM_BINS} << 32;
+
+// Hands objects that are no longer cached back to their pages.
+static void release_objects(const Context &cxt, object *objs, int binid) {
+  for (auto obj = objs; obj;) {
+    auto next = obj->get_next();
+    cxt.get_page(obj)->get_heap()->deferred_free(binid, obj);
+    obj = next;
+  }
+}
+
+// A Sheap attached to the heap, and the process it is in.
+struct User {
+  std::atomic<bool> m_attached = false;
+  std::atomic<int> m_pid = 0;
+};
+
+// A partition of the heap with heaps, thread caches and transfer caches of its
+// own, so that its pages can be accounted for and limited.
+struct Tenant {
+  static constexpr std::size_t MAX_NAME = 32;
+
+  Quota m_quota;
+  bool m_in_use = false;
+  char m_name[MAX_NAME] = {};
+};
+
 struct Sheap::impl {
-  impl(Context &cxt, Heap *heaps, int num_heaps, ThreadCache **tcache,
-       int max_threads)
-      : m_cxt(cxt), m_heaps(heaps), m_num_heaps(num_heaps), m_tcache(tcache),
-        m_max_threads(max_threads) {}
+  impl(void *mem, std::size_t size, Context &cxt, PageAllocator &page_alloc,
+       Tenant *tenants, int max_tenants, Heap *heaps, int num_heaps,
+       TransferCache *transfer, ThreadCache **tcache, int max_threads,
+       EpochRecord *epochs, HandleTable &handles, Page *null_page)
+      : m_mem(mem), m_size(size), m_cxt(cxt), m_page_alloc(page_alloc),
+        m_tenants(tenants), m_max_tenants(max_tenants), m_heaps(heaps),
+        m_num_heaps(num_heaps), m_transfer(transfer), m_tcache(tcache),
+        m_max_threads(max_threads), m_epoch(epochs, max_threads),
+        m_handles(handles), m_null_page(null_page) {}
   impl(const impl &) = delete;
   impl(impl &&) = delete;
 
-  const Context &m_cxt;
+  // Written last by create(), so a heap that is half set up is never opened.
+  std::uint64_t m_magic = 0;
+  std::uint64_t m_layout = 0;
+  void *const m_mem;
+  const std::size_t m_size;
+  // One per Sheap attached, see needs_recovery().
+  static constexpr int MAX_USERS = 64;
+  User m_users[MAX_USERS] = {};
+  std::atomic<void *> m_root = nullptr;
+  // Set while a thread has the other tenants reclaim, see reclaim_others().
+  std::atomic<bool> m_reclaiming = false;
+  Directory m_directory = {};
+
+  Context &m_cxt;
+  PageAllocator &m_page_alloc;
+  SpinLock m_tenant_mtx = {};
+  Tenant *const m_tenants;
+  const int m_max_tenants;
+  // Tenant by tenant: heaps, transfer caches per bin and thread caches.
   Heap *const m_heaps;
   const int m_num_heaps;
+  TransferCache *const m_transfer;
   ThreadCache *const *const m_tcache;
   const int m_max_threads;
+  // One record per thread slot, shared by the tenants.
+  EpochManager m_epoch;
+  // Where the objects of handles are, see Sheap::alloc_handle().
+  HandleTable &m_handles;
+  // What thread caches holding no page point at, see Page::init_null().
+  Page *const m_null_page;
+
+  Heap *get_heaps(int tenant) const noexcept {
+    return m_heaps + tenant * m_num_heaps;
+  }
+  Heap &get_heap(int tenant, int tid) const noexcept {
+    return get_heaps(tenant)[tid & (m_num_heaps - 1)];
+  }
+  TransferCache *get_transfer(int tenant) const noexcept {
+    return m_transfer + tenant * NUM_BINS;
+  }
+  ThreadCache *get_tcache(int tenant, int tid) const noexcept {
+    return m_tcache[tenant * m_max_threads + (tid & (m_max_threads - 1))];
+  }
+  int tenant_of(const Heap *heap) const noexcept {
+    return (heap - m_heaps) / m_num_heaps;
+  }
+
+  int attach() {
+    for (int i = 0; i < MAX_USERS; i++) {
+      auto &user = m_users[i];
+      if (!user.m_attached.exchange(true, std::memory_order_acquire)) {
+        user.m_pid.store(current_pid(), std::memory_order_release);
+        return i;
+      }
+    }
+    throw std::runtime_error{"sheap: too many users attached"};
+  }
+
+  FreePageList alloc_pages(int tenant, Heap &heap, int binid) noexcept {
+    if (auto pages = heap.alloc_pages(binid); BOOST_LIKELY(!pages.empty()))
+      return pages;
+
+    return alloc_pages_fallback(tenant, heap, binid);
+  }
+
+  // Outer locks first: the handle table allocates under its lock, regions
+  // are locked around the page allocator and bins, and page caches around
+  // the page allocator.
+  template <typename Fn> void for_each_lock(Fn &&fn) noexcept {
+    fn(m_tenant_mtx);
+    fn(m_handles.get_lock());
+    fn(m_cxt.get_regions().get_lock());
+    for (int i = 0; i < m_max_tenants * NUM_BINS; i++)
+      fn(m_transfer[i].get_lock());
+    for (int i = 0; i < m_max_tenants * m_num_heaps; i++)
+      m_heaps[i].for_each_lock(fn);
+    fn(m_page_alloc.get_lock());
+  }
+
+  void drain_transfer_caches(int tenant) noexcept {
+    auto transfer = get_transfer(tenant);
+    for (int i = 0; i < NUM_BINS; i++) {
+      while (auto batch = transfer[i].remove())
+        release_objects(m_cxt, batch, i);
+    }
+  }
+
+  // Applies every pending free of the tenant and gives back its empty pages.
+  void reclaim(int tenant) noexcept {
+    drain_transfer_caches(tenant);
+
+    auto heaps = get_heaps(tenant);
+    for (int i = 0; i < m_num_heaps; i++)
+      heaps[i].collect_garbage(true);
+  }
+
+  // Whether reclaim(tenant) would give anything back: frees not yet applied,
+  // batches in transfer caches or cached pages.
+  bool has_garbage(int tenant) const noexcept {
+    auto transfer = get_transfer(tenant);
+    for (int i = 0; i < NUM_BINS; i++) {
+      if (!transfer[i].is_empty())
+        return true;
+    }
+
+    auto heaps = get_heaps(tenant);
+    for (int i = 0; i < m_num_heaps; i++) {
+      if (heaps[i].has_garbage())
+        return true;
+    }
+    return false;
+  }
+
+private:
+  // Has every tenant but `tenant` reclaim what it can, skipping those with
+  // nothing to give back since they last did. One thread does so at a time:
+  // the others wait for it to finish and try what it freed instead.
+  void reclaim_others(int tenant) noexcept {
+    if (m_reclaiming.exchange(true, std::memory_order_acquire)) {
+      boost::interprocess::spin_wait swait;
+      while (m_reclaiming.load(std::memory_order_acquire))
+        swait.yield();
+      return;
+    }
+
+    for (int i = 0; i < m_max_tenants; i++) {
+      if (i != tenant && has_garbage(i))
+        reclaim(i);
+    }
+    m_reclaiming.store(false, std::memory_order_release);
+  }
+
+  // The tenant's quota or the page allocator is exhausted. Before failing,
+  // the tenant reclaims its own pages, then goes over a soft quota, then has
+  // the other tenants reclaim theirs unless its quota is what stops it, and
+  // finally borrows partial pages from its other heaps. Borrowed pages keep
+  // their owner, which gets them back once the thread cache is done.
+  FreePageList alloc_pages_fallback(int tenant, Heap &heap,
+                                    int binid) noexcept {
+    auto &quota = m_tenants[tenant].m_quota;
+
+    reclaim(tenant);
+    if (auto pages = heap.alloc_pages(binid); !pages.empty())
+      return pages;
+
+    if (!quota.is_hard()) {
+      if (auto pages = heap.alloc_pages(binid, true); !pages.empty())
+        return pages;
+    }
+
+    if (!quota.is_hard() || !quota.is_full()) {
+      reclaim_others(tenant);
+      if (auto pages = heap.alloc_pages(binid, true); !pages.empty())
+        return pages;
+    }
+
+    auto heaps = get_heaps(tenant);
+    for (int i = 0; i < m_num_heaps; i++) {
+      if (auto pages = heaps[i].lend_partial_pages(binid); !pages.empty())
+        return pages;
+    }
+
+    return {};
+  }
 };
 
-template <typename T>
+template <typename T, std::size_t Align = alignof(T)>
 static T *alloc_internal(std::size_t count, void *&mem, std::size_t &space) {
-  if (std::align(alignof(T), sizeof(T) * count, mem, space)) {
+  if (std::align(Align, sizeof(T) * count, mem, space)) {
     auto res = static_cast<T *>(mem);
     asan_unpoison_memory_region(res, sizeof(T) * count);
     mem = static_cast<void *>((static_cast<char *>(mem) + sizeof(T) * count));
@@ -37,76 +246,503 @@ static T *alloc_internal(std::size_t count, void *&mem, std::size_t &space) {
 }
 
 static inline ThreadCache **alloc_tcache(void *&mem, std::size_t &size,
-                                         int max_threads) {
+                                         int max_threads, Page *null_page) {
+  // One row per thread slot of each tenant.
   auto tcache = alloc_internal<ThreadCache *>(max_threads, mem, size);
 
+  // Each thread's caches start on a fresh line (and the page array following
+  // the last one is line aligned too), so the last bin of one thread and the
+  // first bin of the next are never written from two cores.
   for (int i = 0; i < max_threads; i++) {
-    tcache[i] = alloc_internal<ThreadCache>(NUM_BINS, mem, size);
+    tcache[i] =
+        alloc_internal<ThreadCache, CACHELINE_SIZE>(NUM_BINS, mem, size);
 
     for (int j = 0; j < NUM_BINS; j++)
-      detail::construct(&tcache[i][j]);
+      detail::construct(&tcache[i][j], null_page);
   }
 
   return tcache;
 }
 
 Sheap::Sheap(void *mem, std::size_t size, const config &c)
-    : m_imp(create(mem, size, c)) {}
+    : m_imp(create(mem, size, c)), m_tcache(m_imp->m_tcache),
+      m_thread_mask(m_imp->m_max_threads - 1), m_user(m_imp->attach()) {}
+
+Sheap::Sheap(void *mem, std::size_t size, open_existing_t)
+    : m_imp(open(mem, size)), m_tcache(m_imp->m_tcache),
+      m_thread_mask(m_imp->m_max_threads - 1), m_user(m_imp->attach()) {}
 
 Sheap::impl *Sheap::create(void *mem, std::size_t size, const config &c) {
   BOOST_ASSERT(c.max_threads > 0);
+  auto orig_mem = mem;
+  auto orig_size = size;
 
   asan_poison_memory_region(mem, size);
 
+  BOOST_ASSERT(c.max_tenants > 0);
   auto num_heaps = detail::next_pow_2(c.num_heaps);
   auto max_threads = detail::next_pow_2(c.max_threads);
+  auto max_tenants = c.max_tenants;
 
   auto imp = alloc_internal<impl>(1, mem, size);
   auto cxt = alloc_internal<Context>(1, mem, size);
   auto page_alloc = alloc_internal<PageAllocator>(1, mem, size);
-  auto heaps = alloc_internal<Heap>(num_heaps, mem, size);
-  auto tcache = alloc_tcache(mem, size, max_threads);
+  auto tenants = alloc_internal<Tenant>(max_tenants, mem, size);
+  auto heaps = alloc_internal<Heap>(max_tenants * num_heaps, mem, size);
+  auto transfer =
+      alloc_internal<TransferCache>(max_tenants * NUM_BINS, mem, size);
+  auto null_page = alloc_internal<Page>(1, mem, size);
+  null_page->init_null();
+  auto tcache = alloc_tcache(mem, size, max_tenants * max_threads, null_page);
+  auto epochs = alloc_internal<EpochRecord>(max_threads, mem, size);
+  auto handles = alloc_internal<HandleTable>(1, mem, size);
+  if (c.page_array_align != 0 &&
+      !std::align(c.page_array_align, sizeof(Page), mem, size))
+    throw std::bad_alloc{};
   auto num_pages = size / (c.page_size + sizeof(Page)) - 1;
   auto pages = alloc_internal<Page>(num_pages, mem, size);
   auto pages_base = std::align(c.page_size, c.page_size * num_pages, mem, size);
 
   detail::construct(cxt, pages, num_pages, c.page_size, pages_base);
-  detail::construct(page_alloc, pages, num_pages);
+  detail::construct(page_alloc, pages, num_pages,
+                    std::ref(cxt->get_regions()), c.zeroed);
 
-  for (int i = 0; i < num_heaps; i++) {
-    detail::construct(heaps + i, std::ref(*cxt), std::ref(*page_alloc));
+  for (int i = 0; i < max_tenants; i++) {
+    detail::construct(tenants + i);
+
+    for (int j = 0; j < num_heaps; j++) {
+      detail::construct(heaps + i * num_heaps + j, std::ref(*cxt),
+                        std::ref(*page_alloc), std::ref(tenants[i].m_quota));
+    }
   }
+  tenants[0].m_in_use = true;
+
+  for (int i = 0; i < max_tenants * NUM_BINS; i++)
+    detail::construct(transfer + i);
+  for (int i = 0; i < max_threads; i++)
+    detail::construct(epochs + i);
+  detail::construct(handles);
+
+  detail::construct(imp, orig_mem, orig_size, std::ref(*cxt),
+                    std::ref(*page_alloc), tenants, max_tenants, heaps,
+                    num_heaps, transfer, tcache, max_threads, epochs,
+                    std::ref(*handles), null_page);
+  imp->m_layout = LAYOUT;
+  std::atomic_thread_fence(std::memory_order_release);
+  imp->m_magic = MAGIC;
+  return imp;
+}
+
+Sheap::impl *Sheap::open(void *mem, std::size_t size) {
+  auto orig_mem = mem;
+  auto space = size;
+  auto imp = static_cast<impl *>(
+      std::align(alignof(impl), sizeof(impl), mem, space));
+
+  if (imp == nullptr || imp->m_magic != MAGIC || imp->m_layout != LAYOUT ||
+      imp->m_mem != orig_mem || imp->m_size != size) {
+    throw std::invalid_argument{"sheap: no heap created at this address"};
+  }
+
+  // Poisoning is per process, and says nothing of what other processes have
+  // done with the heap since.
+  asan_unpoison_memory_region(orig_mem, size);
+  return imp;
+}
+
+bool Sheap::needs_recovery() const noexcept {
+  bool dead = false;
+  for (int i = 0; i < impl::MAX_USERS; i++) {
+    auto &user = m_imp->m_users[i];
+    if (i == m_user || !user.m_attached.load(std::memory_order_acquire))
+      continue;
+    if (is_alive(user.m_pid.load(std::memory_order_acquire)))
+      return false;
+    dead = true;
+  }
+  return dead;
+}
+
+void Sheap::recover() noexcept {
+  auto &cxt = m_imp->m_cxt;
+  auto &page_alloc = m_imp->m_page_alloc;
+  auto heaps = m_imp->m_heaps;
+  auto num_heaps = m_imp->m_max_tenants * m_imp->m_num_heaps;
+  std::vector<std::array<bool, NUM_BINS>> suspect(num_heaps);
+
+  cxt.get_regions().reset();
+  page_alloc.reset();
+  m_imp->m_directory.reset();
+  m_imp->m_tenant_mtx.reset();
+  m_imp->m_reclaiming = false;
+  for (int i = 0; i < m_imp->m_max_tenants; i++)
+    m_imp->m_tenants[i].m_quota.reset_usage();
+  for (int i = 0; i < num_heaps; i++)
+    heaps[i].reset(suspect[i]);
+
+  // Objects kept by thread caches are leaked, but the transfer caches are
+  // only changed under their lock and can be handed back to the pages.
+  for (int i = 0; i < m_imp->m_max_tenants * NUM_BINS; i++) {
+    auto &transfer = m_imp->m_transfer[i];
+
+    if (!transfer.is_locked()) {
+      transfer.for_each_batch([&](object *batch) {
+        for (auto obj = batch; obj;) {
+          auto next = obj->get_next();
+          obj->unpoison();
+          cxt.get_page(obj)->free(obj);
+          obj->poison();
+          obj = next;
+        }
+      });
+    }
+    detail::construct(&transfer);
+  }
+
+  for (int i = 0; i < m_imp->m_max_tenants * m_imp->m_max_threads; i++) {
+    for (int j = 0; j < NUM_BINS; j++)
+      detail::construct(&m_imp->m_tcache[i][j], m_imp->m_null_page);
+  }
+
+  // Empty pages and those of arenas, which do not outlive their processes,
+  // go back to the page allocator, everything else to the heap that owns it.
+  // Counts are only recomputed where an owner may have died half way through
+  // an update: pages of thread caches and of bins whose lock was held.
+  page_alloc.for_each_page([&](Page *page) {
+    switch (page->get_state()) {
+    case PageState::FREE:
+    case PageState::CACHED:
+    case PageState::ARENA:
+      break;
+
+    case PageState::THREAD:
+    case PageState::HEAP:
+      auto heap = page->get_heap();
+      auto binid = page->get_size_class().binid;
+
+      if (page->get_state() == PageState::THREAD ||
+          suspect[heap - heaps][binid]) {
+        page->recount_free(cxt.get_page_ptr(page));
+      }
+
+      if (!page->is_empty()) {
+        heap->adopt_page(*page);
+        return;
+      }
+      break;
+    }
+
+    page_alloc.free(page);
+  });
+
+  m_imp->m_epoch.recover([this](void *ptr) { free(ptr); });
+  m_imp->m_handles.reset();
+  for (int i = 0; i < impl::MAX_USERS; i++) {
+    if (i != m_user)
+      m_imp->m_users[i].m_attached.store(false, std::memory_order_release);
+  }
+}
+
+bool Sheap::add_region(void *mem, std::size_t size) noexcept {
+  asan_poison_memory_region(mem, size);
+
+  auto &cxt = m_imp->m_cxt;
+  auto region = cxt.get_regions().add(mem, size, cxt.get_page_size());
+  if (region == nullptr)
+    return false;
+
+  m_imp->m_page_alloc.add_region(*region);
+  return true;
+}
+
+std::size_t
+Sheap::release_empty_regions_impl(void (*fn)(void *, void *, std::size_t),
+                                  void *arg) {
+  std::vector<std::pair<void *, std::size_t>> released;
+
+  collect_garbage(-1, true);
+  m_imp->m_cxt.get_regions().remove_if([&](Region &region) {
+    if (!m_imp->m_page_alloc.remove_region_if_empty(region))
+      return false;
+
+    released.emplace_back(region.m_mem, region.m_size);
+    return true;
+  });
+
+  for (auto [mem, size] : released) {
+    asan_unpoison_memory_region(mem, size);
+    fn(arg, mem, size);
+  }
+  return released.size();
+}
+
+Page *Sheap::alloc_arena_page(int tenant, int tid, int order) noexcept {
+  return m_imp->get_heap(tenant, tid).alloc_arena_page(order);
+}
+
+void Sheap::free_arena_pages(int tenant, int tid,
+                             FreePageList &pages) noexcept {
+  for (auto &page : pages) {
+    asan_poison_memory_region(get_page_ptr(&page),
+                              page.num_base_pages() * get_page_size());
+  }
+  m_imp->get_heap(tenant, tid).free_arena_pages(pages);
+}
+
+void *Sheap::get_page_ptr(const Page *page) const noexcept {
+  return m_imp->m_cxt.get_page_ptr(page);
+}
+
+std::size_t Sheap::get_page_size() const noexcept {
+  return m_imp->m_cxt.get_page_size();
+}
+
+void Sheap::close() noexcept {
+  m_imp->m_users[m_user].m_attached.store(false, std::memory_order_release);
+  m_imp = nullptr;
+}
+
+void Sheap::lock_for_fork() noexcept {
+  m_imp->for_each_lock([](SpinLock &lock) { lock.lock(); });
+#ifdef SHEAP_ENABLE_PROFILER
+  if (auto prof = m_prof.load())
+    prof->get_lock().lock();
+#endif
+}
+
+void Sheap::unlock_after_fork() noexcept {
+#ifdef SHEAP_ENABLE_PROFILER
+  if (auto prof = m_prof.load())
+    prof->get_lock().unlock();
+#endif
+  m_imp->for_each_lock([](SpinLock &lock) { lock.unlock(); });
+}
+
+void Sheap::set_root(void *ptr) noexcept { m_imp->m_root = ptr; }
+
+void *Sheap::get_root() const noexcept { return m_imp->m_root; }
+
+void *Sheap::find_or_construct_impl(std::string_view name, std::uint64_t type,
+                                    void *(*make)(void *), void *arg) {
+  return m_imp->m_directory.find_or_insert(name, type,
+                                           [&]() { return make(arg); });
+}
+
+void *Sheap::find_impl(std::string_view name,
+                       std::uint64_t type) const noexcept {
+  return m_imp->m_directory.find(name, type);
+}
+
+int Sheap::create_tenant(const char *name, std::size_t quota,
+                         bool hard) noexcept {
+  if (std::strlen(name) >= Tenant::MAX_NAME)
+    return -1;
+
+  std::lock_guard lock{m_imp->m_tenant_mtx};
+  if (find_tenant_locked(name) >= 0)
+    return -1;
+
+  for (int i = 1; i < m_imp->m_max_tenants; i++) {
+    auto &tenant = m_imp->m_tenants[i];
+
+    if (!tenant.m_in_use) {
+      std::strcpy(tenant.m_name, name);
+      set_quota(i, quota, hard);
+      tenant.m_in_use = true;
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+int Sheap::find_tenant(const char *name) const noexcept {
+  std::lock_guard lock{m_imp->m_tenant_mtx};
+  return find_tenant_locked(name);
+}
+
+int Sheap::find_tenant_locked(const char *name) const noexcept {
+  for (int i = 0; i < m_imp->m_max_tenants; i++) {
+    auto &tenant = m_imp->m_tenants[i];
+
+    if (tenant.m_in_use && std::strcmp(tenant.m_name, name) == 0)
+      return i;
+  }
+
+  return -1;
+}
+
+void Sheap::set_quota(int tenant, std::size_t quota, bool hard) noexcept {
+  BOOST_ASSERT(tenant >= 0 && tenant < m_imp->m_max_tenants);
+  auto page_size = m_imp->m_cxt.get_page_size();
+  m_imp->m_tenants[tenant].m_quota.set_limit(quota / page_size, hard);
+}
+
+std::size_t Sheap::tenant_usage(int tenant) const noexcept {
+  BOOST_ASSERT(tenant >= 0 && tenant < m_imp->m_max_tenants);
+  return m_imp->m_tenants[tenant].m_quota.used() *
+         m_imp->m_cxt.get_page_size();
+}
 
-  return detail::construct(imp, std::ref(*cxt), heaps, num_heaps, tcache,
-                           max_threads);
+void *Sheap::alloc(int tenant, int tid, std::size_t size) noexcept {
+  return alloc<false>(tenant, tid, size);
 }
 
 template <bool IsAlignedAlloc>
-void *Sheap::alloc(int tid, std::size_t size) noexcept {
+void *Sheap::alloc(int tenant, int tid, std::size_t size) noexcept {
   BOOST_ASSERT(size <= max_alloc_size());
+  BOOST_ASSERT(tenant >= 0 && tenant < m_imp->m_max_tenants);
 
   auto binid = BinMap[size];
-  auto &heap = m_imp->m_heaps[tid & (m_imp->m_num_heaps - 1)];
-  auto &tcache = m_imp->m_tcache[tid & (m_imp->m_max_threads - 1)][binid];
+  auto &heap = m_imp->get_heap(tenant, tid);
+  auto &tcache = m_imp->get_tcache(tenant, tid)[binid];
 
   auto ret = tcache.alloc<IsAlignedAlloc>(
-      [&]() { return heap.alloc_pages(binid); },
+      m_imp->get_transfer(tenant)[binid],
+      [&]() { return m_imp->alloc_pages(tenant, heap, binid); },
       [&](auto &&_1) { return heap.push_full_pages(binid, _1); });
-  asan_unpoison_memory_region(ret, size);
+  asan_unpoison_memory_region(ret, Bins[binid].size);
   return ret;
 }
 
-void *Sheap::alloc(int tid, std::size_t size) noexcept {
-  return alloc<false>(tid, size);
+void *Sheap::try_alloc(int tid, std::size_t size,
+                       alloc_error *error) noexcept {
+  BOOST_ASSERT(size <= max_alloc_size());
+  auto binid = BinMap[size];
+  auto &heap = m_imp->get_heap(0, tid);
+  auto &tcache = m_imp->get_tcache(0, tid)[binid];
+  auto contended = false;
+
+  auto ret = tcache.try_alloc(
+      m_imp->get_transfer(0)[binid],
+      [&]() { return heap.try_alloc_pages(binid, contended); },
+      [&](auto &&_1) { heap.try_push_full_pages(binid, _1, contended); },
+      contended);
+  if (BOOST_LIKELY(ret != nullptr)) {
+    asan_unpoison_memory_region(ret, Bins[binid].size);
+    return ret;
+  }
+
+  if (error != nullptr) {
+    if (contended)
+      *error = alloc_error::CONTENDED;
+    else if (heap.get_quota().is_full())
+      *error = alloc_error::OVER_QUOTA;
+    else
+      *error = alloc_error::NO_MEMORY;
+  }
+  return nullptr;
+}
+
+void *Sheap::alloc_near(int tid, std::size_t size, const void *hint) noexcept {
+  BOOST_ASSERT(size <= max_alloc_size());
+  auto &cxt = m_imp->m_cxt;
+
+  if (hint == nullptr || !cxt.contains(hint))
+    return alloc(tid, size);
+
+  auto binid = BinMap[size];
+  auto page = cxt.get_page(hint);
+  void *mem = nullptr;
+
+  // Only pages of tenant 0, as alloc() uses. The owner may change under us,
+  // so it is read once here and checked again under its heap's lock.
+  auto heap = page->get_heap();
+  if (heap != nullptr && m_imp->tenant_of(heap) == 0)
+    mem = heap->alloc_from(binid, *page);
+  if (mem == nullptr)
+    mem = m_imp->get_tcache(0, tid)[binid].alloc_near(page);
+  if (mem == nullptr)
+    return alloc(tid, size);
+
+  asan_unpoison_memory_region(mem, Bins[binid].size);
+  return mem;
+}
+
+void *Sheap::alloc_wait(int tid, std::size_t size,
+                        std::chrono::nanoseconds timeout) noexcept {
+  auto &waiters = m_imp->m_page_alloc.get_waiters();
+
+  // Nobody gets ahead of those already waiting, unless with memory its own
+  // thread cache holds.
+  if (!waiters.has_waiters() || available(tid, size) != 0) {
+    if (auto mem = alloc(tid, size))
+      return mem;
+  }
+
+  using clock = std::chrono::steady_clock;
+  auto now = clock::now();
+  auto deadline =
+      timeout < clock::time_point::max() - now ? now + timeout
+                                               : clock::time_point::max();
+  return waiters.wait([&] { return alloc(tid, size); }, deadline);
+}
+
+void *Sheap::alloc_slow(int tid, std::size_t size) noexcept {
+  return alloc<false>(0, tid, size);
+}
+
+#ifdef SHEAP_ENABLE_PROFILER
+void *Sheap::alloc_sampled(int tid, std::size_t size) noexcept {
+  auto binid = BinMap[size];
+  auto &tcache = m_imp->m_tcache[tid & (m_imp->m_max_threads - 1)][binid];
+  auto prof = m_prof.load(std::memory_order_acquire);
+
+  if (prof == nullptr) {
+    tcache.set_sample_distance(Profiler::RECHECK_DISTANCE);
+    return alloc<false>(0, tid, size);
+  }
+
+  tcache.set_sample_distance(prof->next_sample_distance());
+  auto ptr = alloc<false>(0, tid, size);
+  if (ptr != nullptr && prof->is_enabled()) {
+    m_imp->m_cxt.get_page(ptr)->set_has_sampled();
+    prof->record_alloc(ptr, size);
+  }
+
+  return ptr;
+}
+
+void Sheap::start_profiling(std::size_t sample_period) noexcept {
+  auto prof = m_prof.load(std::memory_order_acquire);
+
+  if (prof == nullptr) {
+    auto fresh = new (std::nothrow) Profiler{};
+    if (fresh == nullptr)
+      return;
+
+    if (m_prof.compare_exchange_strong(prof, fresh,
+                                       std::memory_order_acq_rel)) {
+      prof = fresh;
+    } else {
+      delete fresh;
+    }
+  }
+
+  prof->start(sample_period);
 }
 
+void Sheap::stop_profiling() noexcept {
+  if (auto prof = m_prof.load(std::memory_order_acquire))
+    prof->stop();
+}
+
+void Sheap::dump_heap_profile(std::ostream &os) const {
+  if (auto prof = m_prof.load(std::memory_order_acquire)) {
+    prof->dump(os);
+  } else {
+    Profiler{}.dump(os);
+  }
+}
+#endif
+
 void *Sheap::aligned_alloc(int tid, std::size_t size,
                            std::size_t align) noexcept {
   auto binid = detail::BinMap[size];
   if (static_cast<std::size_t>(detail::Bins[binid].alignment) >= align) {
-    return alloc<false>(tid, size);
+    return alloc(tid, size);
   } else {
-    auto unaligned = alloc<true>(tid, size + align - 1);
+    auto unaligned = alloc<true>(0, tid, size + align - 1);
     auto aligned = boost::alignment::align_up(unaligned, align);
     auto in_acccessible = to_int(aligned) - to_int(unaligned);
 
@@ -121,19 +757,355 @@ void Sheap::free(void *ptr) noexcept {
   auto heap = page->get_heap();
   auto binid = szc.binid;
 
+#ifdef SHEAP_ENABLE_PROFILER
+  // Before the object can be reused and sampled again.
+  if (BOOST_UNLIKELY(page->has_sampled()))
+    m_prof.load()->record_free(ptr);
+#endif
+
   asan_poison_memory_region(obj, szc.bin.size);
   heap->deferred_free(binid, obj);
 }
 
-void Sheap::collect_garbage(int tid, bool flush_cache) noexcept {
-  if (tid < 0) {
-    for (auto heap = m_imp->m_heaps, end = heap + m_imp->m_num_heaps;
-         heap != end; heap++) {
-      heap->collect_garbage(flush_cache);
+void Sheap::free(int tid, void *ptr) noexcept {
+  BOOST_ASSERT(ptr != nullptr);
+  auto [obj, page, szc] = m_imp->m_cxt.get_alloc_info(ptr);
+  auto binid = szc.binid;
+  auto tenant = m_imp->tenant_of(page->get_heap());
+  auto &tcache = m_imp->get_tcache(tenant, tid)[binid];
+
+#ifdef SHEAP_ENABLE_PROFILER
+  if (BOOST_UNLIKELY(page->has_sampled()))
+    m_prof.load()->record_free(ptr);
+#endif
+
+  asan_poison_memory_region(obj, szc.bin.size);
+  if (auto batch = tcache.free(object::from(obj))) {
+    if (!m_imp->get_transfer(tenant)[binid].insert(batch))
+      release_objects(m_imp->m_cxt, batch, binid);
+  }
+}
+
+void Sheap::flush_thread_cache(int tid) noexcept {
+  for (int i = 0; i < m_imp->m_max_tenants; i++) {
+    auto tcache = m_imp->get_tcache(i, tid);
+    auto &heap = m_imp->get_heap(i, tid);
+
+    for (int j = 0; j < NUM_BINS; j++) {
+      release_objects(m_imp->m_cxt, tcache[j].flush(), j);
+
+      if (auto pages = tcache[j].flush_pages(); !pages.empty())
+        heap.push_pages(j, pages);
     }
+  }
+}
+
+std::size_t Sheap::reserve(int tid, std::size_t size,
+                           std::size_t count) noexcept {
+  BOOST_ASSERT(size <= max_alloc_size());
+  auto binid = BinMap[size];
+  auto &heap = m_imp->get_heap(0, tid);
+  auto &tcache = m_imp->get_tcache(0, tid)[binid];
+
+  tcache.reserve(
+      count, [&]() { return m_imp->alloc_pages(0, heap, binid); },
+      [&](Page &page) { page.prefault(m_imp->m_cxt.get_page_ptr(&page)); });
+  return tcache.available();
+}
+
+std::size_t Sheap::available(int tid, std::size_t size) const noexcept {
+  BOOST_ASSERT(size <= max_alloc_size());
+  return m_imp->get_tcache(0, tid)[BinMap[size]].available();
+}
+
+bool Sheap::contains(const void *ptr) const noexcept {
+  return m_imp->m_cxt.contains(ptr);
+}
+
+std::size_t Sheap::usable_size(const void *ptr) const noexcept {
+  auto [obj, page, szc] = m_imp->m_cxt.get_alloc_info(const_cast<void *>(ptr));
+  return szc.bin.size - (to_int(ptr) - to_int(obj));
+}
+
+void Sheap::free_in_bin(void *ptr, int binid) noexcept {
+  BOOST_ASSERT(ptr != nullptr);
+  auto page = m_imp->m_cxt.get_page(ptr);
+  BOOST_ASSERT(page->get_size_class().binid == binid);
+
+#ifdef SHEAP_ENABLE_PROFILER
+  if (BOOST_UNLIKELY(page->has_sampled()))
+    m_prof.load()->record_free(ptr);
+#endif
+
+  asan_poison_memory_region(ptr, Bins[binid].size);
+  page->get_heap()->deferred_free(binid, ptr);
+}
+
+void Sheap::epoch_enter(int tid) noexcept {
+  m_imp->m_epoch.enter(tid & m_thread_mask);
+}
+
+void Sheap::epoch_exit(int tid) noexcept {
+  m_imp->m_epoch.exit(tid & m_thread_mask);
+}
+
+void Sheap::retire(int tid, void *ptr) noexcept {
+  BOOST_ASSERT(ptr != nullptr);
+  m_imp->m_epoch.retire(tid & m_thread_mask, static_cast<object *>(ptr),
+                        [this](void *obj) { free(obj); });
+}
+
+void Sheap::epoch_collect(int tid) noexcept {
+  m_imp->m_epoch.collect(tid & m_thread_mask,
+                         [this](void *obj) { free(obj); });
+}
+
+handle Sheap::alloc_handle(int tid, std::size_t size) noexcept {
+  auto mem = alloc(tid, size);
+  if (mem == nullptr)
+    return handle{};
+
+  auto h = m_imp->m_handles.insert(
+      mem, [&]() { return alloc(tid, max_alloc_size()); });
+  if (h == 0)
+    free(mem);
+  return handle{h};
+}
+
+void Sheap::free_handle(handle h) noexcept {
+  auto &e = m_imp->m_handles.find(static_cast<std::uint64_t>(h));
+  HandleTable::lock(e);
+  auto ptr = e.get();
+  m_imp->m_handles.erase(static_cast<std::uint64_t>(h));
+  free(ptr);
+}
+
+void *Sheap::pin(handle h) noexcept {
+  return HandleTable::pin(
+      m_imp->m_handles.find(static_cast<std::uint64_t>(h)));
+}
+
+void Sheap::unpin(handle h) noexcept {
+  HandleTable::unpin(m_imp->m_handles.find(static_cast<std::uint64_t>(h)));
+}
+
+std::size_t Sheap::compact(int tid, double max_occupancy) {
+  struct sparse_pages {
+    Heap *heap;
+    int binid;
+    FreePageList pages;
+  };
+  auto &cxt = m_imp->m_cxt;
+  auto heaps = m_imp->get_heaps(0);
+  std::vector<sparse_pages> sparse;
+  std::vector<const Page *> evacuated;
+
+  // The pages are off their heap's lists while their objects move, so
+  // nothing is allocated from them and frees to them wait.
+  for (int i = 0; i < m_imp->m_num_heaps; i++) {
+    for (int j = 0; j < NUM_BINS; j++) {
+      auto pages = heaps[i].take_sparse_pages(j, max_occupancy);
+      if (pages.empty())
+        continue;
+
+      for (auto &page : pages)
+        evacuated.push_back(&page);
+      sparse.push_back({&heaps[i], j, std::move(pages)});
+    }
+  }
+  std::sort(evacuated.begin(), evacuated.end());
+
+  auto is_evacuated = [&](void *ptr) {
+    return ptr != nullptr && std::binary_search(evacuated.begin(),
+                                                evacuated.end(),
+                                                cxt.get_page(ptr));
+  };
+
+  std::size_t num_moved = 0;
+  if (!evacuated.empty()) {
+    m_imp->m_handles.for_each([&](HandleTable::Entry &e) {
+      if (!is_evacuated(e.get()) || !HandleTable::try_lock(e))
+        return;
+
+      // The handle may have been freed and reused before it was locked.
+      auto ptr = e.get();
+      auto page = is_evacuated(ptr) ? cxt.get_page(ptr) : nullptr;
+      auto size = page ? page->get_size_class().bin.size : 0;
+
+      if (auto mem = page ? alloc(tid, size) : nullptr) {
+        std::memcpy(mem, ptr, size);
+        e.set(mem);
+
+#ifdef SHEAP_ENABLE_PROFILER
+        if (BOOST_UNLIKELY(page->has_sampled()))
+          m_prof.load()->record_free(ptr);
+#endif
+        // Nobody else touches the counts of a page off its heap's lists.
+        auto obj = object::from(ptr);
+        asan_poison_memory_region(obj, size);
+        obj->unpoison();
+        page->free(obj);
+        obj->poison();
+        num_moved++;
+      }
+      HandleTable::unlock(e);
+    });
+  }
+
+  for (auto &s : sparse)
+    s.heap->push_pages(s.binid, s.pages);
+  return num_moved;
+}
+
+heap_stats Sheap::stats() noexcept {
+  auto num_heaps = m_imp->m_max_tenants * m_imp->m_num_heaps;
+  heap_stats st;
+
+  for (int i = 0; i < num_heaps; i++) {
+    m_imp->m_heaps[i].for_each_page([&](Page &page) {
+      auto &szc = page.get_size_class();
+      st.page_bytes += szc.num_objs * szc.bin.size;
+      st.free_bytes += page.num_free() * szc.bin.size;
+      st.num_partial_pages += !page.is_full();
+    });
+  }
+
+  return st;
+}
+
+void Sheap::walk_impl(void (*fn)(void *, void *, std::size_t), void *arg,
+                      bool stopped) {
+  auto &cxt = m_imp->m_cxt;
+  auto num_heaps = m_imp->m_max_tenants * m_imp->m_num_heaps;
+  std::size_t max_objs = 0;
+
+  for (int i = 0; i < NUM_BINS; i++)
+    max_objs = std::max(max_objs, cxt.get_size_class(i).num_objs);
+
+  std::vector<std::uint64_t> bitmap((max_objs + 63) / 64);
+  std::vector<void *> deferred;
+  auto walk_page = [&](Page &page) {
+    auto size = page.get_size_class().bin.size;
+    page.for_each_allocated(
+        cxt.get_page_ptr(&page), bitmap.data(), [&](void *obj) {
+          if (!std::binary_search(deferred.begin(), deferred.end(), obj))
+            fn(arg, obj, size);
+        });
+  };
+
+  if (stopped) {
+    // Pages of thread caches are on no list, so take them all from the page
+    // array. Frees to them can only be applied by their owner, so the pending
+    // and the cached ones are looked up instead.
+    auto add_deferred = [&](void *obj) { deferred.push_back(obj); };
+
+    for (int i = 0; i < num_heaps; i++)
+      m_imp->m_heaps[i].for_each_deferred(add_deferred);
+
+    for (int i = 0; i < m_imp->m_max_tenants * NUM_BINS; i++) {
+      m_imp->m_transfer[i].for_each_batch([&](object *batch) {
+        for (auto obj = batch; obj; obj = obj->get_next())
+          deferred.push_back(obj);
+      });
+    }
+
+    for (int i = 0; i < m_imp->m_max_tenants * m_imp->m_max_threads; i++) {
+      for (int j = 0; j < NUM_BINS; j++)
+        m_imp->m_tcache[i][j].for_each_obj(add_deferred);
+    }
+    std::sort(deferred.begin(), deferred.end());
+
+    m_imp->m_page_alloc.for_each_page([&](Page *page) {
+      if (page->get_state() == PageState::THREAD ||
+          page->get_state() == PageState::HEAP) {
+        walk_page(*page);
+      }
+    });
   } else {
-    auto &heap = m_imp->m_heaps[tid & (m_imp->m_num_heaps - 1)];
-    heap.collect_garbage(flush_cache);
+    // Every page is looked at in the page array, as in a stopped walk, but
+    // pages of heaps under their bin's lock and pages of thread caches from
+    // a snapshot. Frees not yet applied to their page are subtracted: those
+    // in transfer caches go back to their pages first. fn() may allocate or
+    // free, so it is called with no lock held.
+    std::vector<std::pair<void *, std::size_t>> objs;
+    auto add_deferred = [&](void *obj) { deferred.push_back(obj); };
+    auto collect = [&](Page &page) {
+      auto size = page.get_size_class().bin.size;
+      page.for_each_allocated(
+          cxt.get_page_ptr(&page), bitmap.data(),
+          [&](void *obj) { objs.emplace_back(obj, size); });
+    };
+    auto collect_page = [&](Page &page) {
+      while (true) {
+        auto state = page.racy_state();
+        if (state == PageState::HEAP) {
+          auto heap = page.racy_heap();
+          if (heap != nullptr && heap->with_page_locked(page, collect))
+            return;
+        } else if (state == PageState::THREAD) {
+          if (page.snapshot_allocated(cxt.get_page_ptr(&page), bitmap.data(),
+                                      [&](void *obj, std::size_t size) {
+                                        objs.emplace_back(obj, size);
+                                      }))
+            return;
+        } else {
+          return;
+        }
+        BOOST_INTERPROCESS_SMT_PAUSE;
+      }
+    };
+    auto report = [&] {
+      for (auto [obj, size] : objs) {
+        if (!std::binary_search(deferred.begin(), deferred.end(), obj))
+          fn(arg, obj, size);
+      }
+      objs.clear();
+    };
+
+    for (int i = 0; i < m_imp->m_max_tenants; i++)
+      m_imp->drain_transfer_caches(i);
+    for (int i = 0; i < num_heaps; i++)
+      m_imp->m_heaps[i].for_each_deferred_locked(add_deferred);
+
+    // A link read in the middle of a change may point anywhere, so regions
+    // are kept mapped meanwhile.
+    auto &regions = cxt.get_regions();
+    regions.pin([&] {
+      auto valid = [&](object *obj) { return cxt.contains(obj); };
+      for (int i = 0; i < m_imp->m_max_tenants * m_imp->m_max_threads; i++) {
+        for (int j = 0; j < NUM_BINS; j++)
+          m_imp->m_tcache[i][j].copy_objs(deferred, valid);
+      }
+    });
+    std::sort(deferred.begin(), deferred.end());
+
+    auto [pages, num_pages] = m_imp->m_page_alloc.get_carved();
+    for (std::size_t i = 0; i < num_pages; i++) {
+      collect_page(pages[i]);
+      report();
+    }
+
+    regions.pin([&] {
+      regions.for_each([&](Region &region) {
+        for (std::size_t i = 0; i < region.m_num_pages; i++)
+          collect_page(region.m_pages[i]);
+      });
+    });
+    report();
+  }
+}
+
+void Sheap::collect_garbage(int tid, bool flush_cache) noexcept {
+  for (int i = 0; i < m_imp->m_max_tenants; i++) {
+    m_imp->drain_transfer_caches(i);
+
+    if (tid < 0) {
+      auto heaps = m_imp->get_heaps(i);
+      for (int j = 0; j < m_imp->m_num_heaps; j++)
+        heaps[j].collect_garbage(flush_cache);
+    } else {
+      m_imp->get_heap(i, tid).collect_garbage(flush_cache);
+    }
   }
 }
 
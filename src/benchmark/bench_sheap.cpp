@@ -1,13 +1,31 @@
 #include "sheap/Sheap.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <benchmark/benchmark.h>
+#include <cstdint>
 #include <cstdlib>
+#include <initializer_list>
 #include <iterator>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
+
+#ifdef __GLIBC__
+// glibc's own entry points, which a replacement malloc does not interpose.
+extern "C" void *__libc_malloc(std::size_t);
+extern "C" void __libc_free(void *);
+#endif
+
 template <typename T1, typename T2> constexpr auto alloc_range(T1 &&a, T2 &&b) {
   return std::make_pair(a, b);
 }
@@ -29,24 +47,81 @@ private:
       alloc_range(80, 512), alloc_range(512, 1024), alloc_range(1024, 4096)};
 };
 
+// Whatever malloc the process ends up with, e.g. one that is preloaded.
 class MallocAllocator {
 public:
   void *alloc(int, std::size_t size) { return std::malloc(size); }
   void free(void *ptr) { std::free(ptr); }
 
+  static const char *name() { return "malloc"; }
+  static bool available() { return true; }
+
   static MallocAllocator &instance(int) {
     static auto Instance = std::make_unique<MallocAllocator>();
     return *Instance;
   }
 };
 
+#ifdef __GLIBC__
+// glibc's malloc, even if another one replaces malloc.
+class GlibcAllocator {
+public:
+  void *alloc(int, std::size_t size) { return __libc_malloc(size); }
+  void free(void *ptr) { __libc_free(ptr); }
+
+  static const char *name() { return "glibc"; }
+  static bool available() { return true; }
+
+  static GlibcAllocator &instance(int) {
+    static auto Instance = std::make_unique<GlibcAllocator>();
+    return *Instance;
+  }
+};
+#endif
+
+#ifndef _WIN32
+// jemalloc through its own API, loaded at run time and kept out of the
+// global scope so that it does not replace malloc for everything else.
+// Skipped if it is not installed.
+class JemallocAllocator {
+public:
+  JemallocAllocator() {
+    for (auto lib : {"libjemalloc.so.2", "libjemalloc.so"}) {
+      if (auto handle = dlopen(lib, RTLD_NOW | RTLD_LOCAL)) {
+        mallocx = reinterpret_cast<decltype(mallocx)>(dlsym(handle, "mallocx"));
+        dallocx = reinterpret_cast<decltype(dallocx)>(dlsym(handle, "dallocx"));
+        if (mallocx != nullptr && dallocx != nullptr)
+          return;
+      }
+    }
+    mallocx = nullptr;
+  }
+
+  void *alloc(int, std::size_t size) { return mallocx(size, 0); }
+  void free(void *ptr) { dallocx(ptr, 0); }
+
+  static const char *name() { return "jemalloc"; }
+  static bool available() { return instance(0).mallocx != nullptr; }
+
+  static JemallocAllocator &instance(int) {
+    static auto Instance = std::make_unique<JemallocAllocator>();
+    return *Instance;
+  }
+
+private:
+  void *(*mallocx)(std::size_t, int) = nullptr;
+  void (*dallocx)(void *, int) = nullptr;
+};
+#endif
+
 class SheapAllocator {
 public:
-  SheapAllocator(int num_heaps)
-      : mem(std::malloc(determine_memory())),
-        sheap(mem, determine_memory(),
-              {static_cast<int>(MAX_THREADS), 64 * 1024,
-               static_cast<size_t>(num_heaps)}) {}
+  SheapAllocator(int num_heaps, int max_threads = MAX_THREADS)
+      : SheapAllocator(num_heaps, max_threads, determine_memory(max_threads)) {}
+  SheapAllocator(int num_heaps, int max_threads, std::size_t size)
+      : mem(std::malloc(size)),
+        sheap(mem, size,
+              {max_threads, 64 * 1024, static_cast<size_t>(num_heaps)}) {}
 
   SheapAllocator(const SheapAllocator &) = delete;
 
@@ -59,6 +134,12 @@ public:
 
   void *alloc(int tid, std::size_t size) { return sheap.alloc(tid, size); }
   void free(void *ptr) { sheap.free(ptr); }
+  // Bytes of pages taken from the segment.
+  std::size_t usage() const { return sheap.tenant_usage(0); }
+  sheap::heap_stats stats() { return sheap.stats(); }
+
+  static const char *name() { return "sheap"; }
+  static bool available() { return true; }
 
   static SheapAllocator &instance(int num_heaps) {
     static auto sheap_allocators = []() {
@@ -76,8 +157,8 @@ public:
   }
 
 private:
-  static std::size_t determine_memory() {
-    return (MAX_LIVE_OBJECTS + MAX_LIVE_OBJECTS / 10) * MAX_THREADS *
+  static std::size_t determine_memory(int max_threads) {
+    return (MAX_LIVE_OBJECTS + MAX_LIVE_OBJECTS / 10) * max_threads *
            sheap::Sheap::max_alloc_size();
   }
   void *mem;
@@ -85,6 +166,11 @@ private:
 };
 
 template <typename Allocator> static void BM_AllocFree(benchmark::State &s) {
+  if (!Allocator::available()) {
+    s.SkipWithError("not installed");
+    return;
+  }
+
   auto alloc_range = s.range(0);
   auto min_allocsize = AllocRanges::get_alloc_range(alloc_range).first;
   auto max_allocsize = AllocRanges::get_alloc_range(alloc_range).second;
@@ -98,7 +184,7 @@ template <typename Allocator> static void BM_AllocFree(benchmark::State &s) {
   std::int64_t total_size_alloc = 0;
 
   auto &a = Allocator::instance(num_heaps - 1);
-  auto tid = s.thread_index;
+  auto tid = s.thread_index();
 
   constexpr auto BATCH_SIZE = 100'000;
   auto prep_batch = [&]() {
@@ -137,6 +223,306 @@ template <typename Allocator> static void BM_AllocFree(benchmark::State &s) {
   free_all();
 }
 
+// Every thread churns its own bin of a single shared heap. Nothing is
+// logically shared, so any slowdown with more threads comes from neighbouring
+// bins' locks and deferred-free heads sharing cache lines.
+static void BM_FalseSharing(benchmark::State &s) {
+  static constexpr auto NUM_THREADS = 64;
+  static constexpr auto ALLOCATOR_SIZE = 256UL * 1024 * 1024;
+  static auto mem = std::unique_ptr<char[]>(new char[ALLOCATOR_SIZE]);
+  static auto sheap = sheap::Sheap{mem.get(), ALLOCATOR_SIZE,
+                                   sheap::config{NUM_THREADS, 64 * 1024, 1}};
+
+  constexpr auto BATCH_SIZE = 256;
+  auto tid = s.thread_index();
+  auto size = sheap::detail::Bins[tid % sheap::detail::NUM_BINS].size;
+  std::array<void *, BATCH_SIZE> ptrs;
+
+  while (s.KeepRunningBatch(BATCH_SIZE)) {
+    for (auto &p : ptrs) {
+      p = sheap.alloc(tid, size);
+      if (p == nullptr) {
+        s.SkipWithError("OOM");
+        return;
+      }
+    }
+
+    for (auto p : ptrs)
+      sheap.free(p);
+  }
+}
+
+// The per-bin words BM_FalseSharing's threads write, without the rest of the
+// allocator: packed as UsedPageStore once had them, its lists, deferred-free
+// head and lock side by side, or each on its own line as it has them now.
+// Run together with it, so that the layouts are compared on one machine.
+template <bool Padded> struct BinWords;
+template <> struct BinWords<false> {
+  std::array<void *, 4> lists;
+  std::atomic<void *> deferred;
+  sheap::detail::SpinLock mtx;
+};
+template <> struct BinWords<true> {
+  alignas(sheap::detail::CACHELINE_SIZE) std::atomic<void *> deferred;
+  alignas(sheap::detail::CACHELINE_SIZE) sheap::detail::SpinLock mtx;
+  std::array<void *, 4> lists;
+};
+
+template <bool Padded>
+static void BM_FalseSharingControl(benchmark::State &s) {
+  static std::array<BinWords<Padded>, 64> bins = {};
+  constexpr auto BATCH_SIZE = 256;
+  auto &bin = bins[s.thread_index()];
+
+  while (s.KeepRunningBatch(BATCH_SIZE)) {
+    for (int i = 0; i < BATCH_SIZE; i++) {
+      auto head = bin.deferred.load(std::memory_order_relaxed);
+      while (!bin.deferred.compare_exchange_weak(head, &bin.lists[i % 4]))
+        ;
+    }
+
+    std::lock_guard lock{bin.mtx};
+    bin.lists[0] = bin.deferred.exchange(nullptr);
+    benchmark::DoNotOptimize(bin.lists);
+  }
+}
+
+// A fixed number of live objects of mixed sizes, each replaced at random, as
+// in a long running service. Reports, for Sheap, the fragmentation of the
+// heap once the run is over; pass --benchmark_min_time to churn for hours.
+template <typename Allocator> static void BM_Churn(benchmark::State &s) {
+  static constexpr auto ALLOCATOR_SIZE = 1024UL * 1024 * 1024;
+  if (!Allocator::available()) {
+    s.SkipWithError("not installed");
+    return;
+  }
+
+  auto a = [] {
+    if constexpr (std::is_same_v<Allocator, SheapAllocator>) {
+      return std::make_unique<SheapAllocator>(1, 1, ALLOCATOR_SIZE);
+    } else {
+      return std::make_unique<Allocator>();
+    }
+  }();
+
+  std::mt19937 gen{42};
+  std::geometric_distribution<std::size_t> dist(0.01);
+  auto next_size = [&]() {
+    return std::min<std::size_t>(16 + dist(gen) * 8, 4096);
+  };
+
+  std::vector<void *> live(s.range(0));
+  for (auto &p : live)
+    p = a->alloc(0, next_size());
+
+  std::uniform_int_distribution<std::size_t> pick(0, live.size() - 1);
+  for (auto _ : s) {
+    auto &p = live[pick(gen)];
+    a->free(p);
+    p = a->alloc(0, next_size());
+
+    if (p == nullptr) {
+      s.SkipWithError("OOM");
+      break;
+    }
+  }
+
+  if constexpr (std::is_same_v<Allocator, SheapAllocator>) {
+    auto st = a->stats();
+    s.counters["fragmentation"] = st.fragmentation();
+    s.counters["partial_pages"] = st.num_partial_pages;
+    s.counters["page_MiB"] = static_cast<double>(st.page_bytes) / (1 << 20);
+  }
+  for (auto p : live) {
+    if (p != nullptr)
+      a->free(p);
+  }
+}
+
+// Bounded lock-free queue of pointers for many producers and consumers, after
+// Vyukov: each cell's sequence number says whose turn it is.
+class PtrRing {
+public:
+  static constexpr std::size_t CAPACITY = 4096;
+
+  PtrRing() {
+    for (std::size_t i = 0; i < CAPACITY; i++)
+      m_cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  bool push(void *ptr) {
+    auto pos = m_tail.load(std::memory_order_relaxed);
+    while (true) {
+      auto &cell = m_cells[pos % CAPACITY];
+      auto diff = static_cast<std::intptr_t>(
+          cell.seq.load(std::memory_order_acquire) - pos);
+
+      if (diff < 0)
+        return false;
+      if (diff > 0) {
+        pos = m_tail.load(std::memory_order_relaxed);
+      } else if (m_tail.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+        cell.ptr = ptr;
+        cell.seq.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+    }
+  }
+
+  bool pop(void *&ptr) {
+    auto pos = m_head.load(std::memory_order_relaxed);
+    while (true) {
+      auto &cell = m_cells[pos % CAPACITY];
+      auto diff = static_cast<std::intptr_t>(
+          cell.seq.load(std::memory_order_acquire) - (pos + 1));
+
+      if (diff < 0)
+        return false;
+      if (diff > 0) {
+        pos = m_head.load(std::memory_order_relaxed);
+      } else if (m_head.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+        ptr = cell.ptr;
+        cell.seq.store(pos + CAPACITY, std::memory_order_release);
+        return true;
+      }
+    }
+  }
+
+private:
+  struct Cell {
+    std::atomic<std::size_t> seq;
+    void *ptr;
+  };
+
+  alignas(sheap::detail::CACHELINE_SIZE) std::atomic<std::size_t> m_head = 0;
+  alignas(sheap::detail::CACHELINE_SIZE) std::atomic<std::size_t> m_tail = 0;
+  alignas(sheap::detail::CACHELINE_SIZE) std::array<Cell, CAPACITY> m_cells;
+};
+
+// Shared by the threads of a BM_ProducerConsumer run, made before they start.
+template <typename Allocator> struct ProducerConsumer {
+  static inline std::unique_ptr<Allocator> allocator;
+  static inline std::unique_ptr<PtrRing> ring;
+  static inline std::atomic<bool> out_of_memory;
+
+  static void setup(const benchmark::State &s) {
+    auto num_threads = static_cast<int>(s.range(1) + s.range(2));
+
+    if constexpr (std::is_same_v<Allocator, SheapAllocator>) {
+      allocator = std::make_unique<SheapAllocator>(s.range(3), num_threads);
+    } else {
+      allocator = std::make_unique<Allocator>();
+    }
+    ring = std::make_unique<PtrRing>();
+    out_of_memory = false;
+  }
+  static void teardown(const benchmark::State &) {
+    ring.reset();
+    allocator.reset();
+  }
+};
+
+// The first s.range(1) threads allocate and hand their objects through a
+// ring to the other s.range(2), which free them. Every free is remote, so it
+// goes through the heap's deferred frees, and those to pages a producer's
+// thread cache still holds are requeued until it lets go of them. Each round
+// every producer hands over as many objects as there are consumers and every
+// consumer frees as many as there are producers, so both sides finish
+// together. Reports the objects passed per second and, for Sheap, the most
+// memory the segment had handed out.
+template <typename Allocator>
+static void BM_ProducerConsumer(benchmark::State &s) {
+  if (!Allocator::available()) {
+    s.SkipWithError("not installed");
+    return;
+  }
+
+  using Shared = ProducerConsumer<Allocator>;
+  auto [min_allocsize, max_allocsize] =
+      AllocRanges::get_alloc_range(s.range(0));
+  auto producers = s.range(1);
+  auto consumers = s.range(2);
+  auto tid = s.thread_index();
+  auto is_producer = tid < producers;
+  auto per_round = is_producer ? consumers : producers;
+  auto &a = *Shared::allocator;
+  auto &ring = *Shared::ring;
+
+  std::mt19937 gen(tid);
+  std::uniform_int_distribution<std::size_t> dist(min_allocsize, max_allocsize);
+  std::vector<std::size_t> sizes(1024);
+  std::generate(sizes.begin(), sizes.end(), [&]() { return dist(gen); });
+  std::size_t next = 0;
+  std::size_t peak_usage = 0;
+
+  for (auto _ : s) {
+    for (auto i = 0; i < per_round; i++) {
+      if (is_producer) {
+        // Out of memory, a producer passes on nullptr so that its consumers
+        // are not left waiting.
+        auto ptr = a.alloc(tid, sizes[next++ % sizes.size()]);
+        if (ptr == nullptr)
+          Shared::out_of_memory = true;
+
+        while (!ring.push(ptr))
+          std::this_thread::yield();
+      } else {
+        void *ptr;
+        while (!ring.pop(ptr))
+          std::this_thread::yield();
+
+        if (ptr != nullptr)
+          a.free(ptr);
+      }
+    }
+
+    if constexpr (std::is_same_v<Allocator, SheapAllocator>) {
+      if (tid == 0)
+        peak_usage = std::max(peak_usage, a.usage());
+    }
+  }
+
+  if (!is_producer)
+    s.SetItemsProcessed(s.iterations() * producers);
+  if (tid == 0) {
+    if (Shared::out_of_memory)
+      s.SkipWithError("OOM");
+
+    if constexpr (std::is_same_v<Allocator, SheapAllocator>) {
+      s.counters["peak_MiB"] = static_cast<double>(peak_usage) / (1 << 20);
+    } else {
+      s.SetLabel(Allocator::name());
+    }
+  }
+}
+
+template <typename Allocator>
+static void RegisterProducerConsumer(const char *name,
+                                     std::initializer_list<int> heap_counts) {
+  // Producers to consumers.
+  constexpr auto ratios = std::array{std::pair{1, 1}, std::pair{1, 3},
+                                     std::pair{3, 1}, std::pair{2, 2},
+                                     std::pair{4, 4}};
+
+  for (auto [producers, consumers] : ratios) {
+    auto b = benchmark::RegisterBenchmark(name,
+                                          BM_ProducerConsumer<Allocator>)
+                 ->Setup(ProducerConsumer<Allocator>::setup)
+                 ->Teardown(ProducerConsumer<Allocator>::teardown)
+                 ->Threads(producers + consumers)
+                 ->UseRealTime();
+
+    for (auto alloc_range_id = 0;
+         alloc_range_id <= AllocRanges::get_alloc_sizes_max_range_id();
+         alloc_range_id++) {
+      for (auto num_heaps : heap_counts)
+        b->Args({alloc_range_id, producers, consumers, num_heaps});
+    }
+  }
+}
+
 static void SheapAllocArgsGen(benchmark::internal::Benchmark *b) {
   for (auto alloc_range_id = 0;
        alloc_range_id <= AllocRanges::get_alloc_sizes_max_range_id();
@@ -165,4 +551,47 @@ BENCHMARK_TEMPLATE(BM_AllocFree, SheapAllocator)
 
 BENCHMARK_TEMPLATE(BM_AllocFree, MallocAllocator)
     ->ThreadRange(1, MAX_THREADS)
-    ->Apply(MallocArgsGen);
\ No newline at end of file
+    ->Apply(MallocArgsGen);
+#ifdef __GLIBC__
+BENCHMARK_TEMPLATE(BM_AllocFree, GlibcAllocator)
+    ->ThreadRange(1, MAX_THREADS)
+    ->Apply(MallocArgsGen);
+#endif
+#ifndef _WIN32
+BENCHMARK_TEMPLATE(BM_AllocFree, JemallocAllocator)
+    ->ThreadRange(1, MAX_THREADS)
+    ->Apply(MallocArgsGen);
+#endif
+
+BENCHMARK_TEMPLATE(BM_Churn, SheapAllocator)->Arg(10'000)->Arg(100'000);
+BENCHMARK_TEMPLATE(BM_Churn, MallocAllocator)->Arg(10'000)->Arg(100'000);
+#ifdef __GLIBC__
+BENCHMARK_TEMPLATE(BM_Churn, GlibcAllocator)->Arg(10'000)->Arg(100'000);
+#endif
+#ifndef _WIN32
+BENCHMARK_TEMPLATE(BM_Churn, JemallocAllocator)->Arg(10'000)->Arg(100'000);
+#endif
+
+BENCHMARK(BM_FalseSharing)->ThreadRange(2, 64)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_FalseSharingControl, false)
+    ->ThreadRange(2, 64)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_FalseSharingControl, true)
+    ->ThreadRange(2, 64)
+    ->UseRealTime();
+
+static const auto producer_consumer_registered = []() {
+  RegisterProducerConsumer<SheapAllocator>(
+      "BM_ProducerConsumer<SheapAllocator>", {1, 2, 4, 8});
+  RegisterProducerConsumer<MallocAllocator>(
+      "BM_ProducerConsumer<MallocAllocator>", {0});
+#ifdef __GLIBC__
+  RegisterProducerConsumer<GlibcAllocator>(
+      "BM_ProducerConsumer<GlibcAllocator>", {0});
+#endif
+#ifndef _WIN32
+  RegisterProducerConsumer<JemallocAllocator>(
+      "BM_ProducerConsumer<JemallocAllocator>", {0});
+#endif
+  return true;
+}();
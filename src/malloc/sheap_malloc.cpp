@@ -0,0 +1,347 @@
+// malloc/free replacement on top of Sheap, meant to be LD_PRELOADed into
+// unmodified binaries.
+//
+// On the first allocation a private anonymous mapping is reserved and a Sheap
+// is created over it. Every thread takes a free thread slot for its lifetime.
+// Requests above Sheap::max_alloc_size(), and those of threads that find
+// every slot taken, are served directly by mmap.
+//
+// SHEAP_MALLOC_SIZE     bytes to reserve for the heap (default 4 GiB)
+// SHEAP_MALLOC_THREADS  number of thread slots (default 256)
+
+#include "sheap/Sheap.h"
+
+#include <atomic>
+#include <boost/align/align_down.hpp>
+#include <boost/align/align_up.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SHEAP_EXPORT extern "C" __attribute__((visibility("default")))
+
+namespace {
+constexpr std::size_t DEFAULT_SIZE = std::size_t{4} << 30;
+constexpr int DEFAULT_THREADS = 256;
+constexpr int MAX_THREADS = 4096;
+constexpr std::size_t MIN_ALIGN = alignof(std::max_align_t);
+
+enum { UNINITIALIZED, INITIALIZING, READY, FAILED };
+
+std::atomic<int> g_state = UNINITIALIZED;
+alignas(sheap::Sheap) unsigned char g_sheap_storage[sizeof(sheap::Sheap)];
+sheap::Sheap *g_sheap = nullptr;
+int g_num_threads = 0;
+pthread_key_t g_slot_key;
+std::atomic<std::uint64_t> g_slots[MAX_THREADS / 64] = {};
+
+constexpr int NO_SLOT = -1;
+constexpr int SLOT_RELEASED = -2;
+thread_local int t_tid __attribute__((tls_model("initial-exec"))) = NO_SLOT;
+
+std::size_t env_or(const char *name, std::size_t dflt) {
+  if (auto val = std::getenv(name)) {
+    if (auto n = std::strtoull(val, nullptr, 0))
+      return n;
+  }
+  return dflt;
+}
+
+void release_slot(void *arg) {
+  auto slot = static_cast<int>(reinterpret_cast<std::intptr_t>(arg) - 1);
+
+  t_tid = SLOT_RELEASED;
+  g_sheap->flush_thread_cache(slot);
+  g_slots[slot / 64].fetch_and(~(UINT64_C(1) << (slot % 64)));
+}
+
+int acquire_slot() {
+  for (int word = 0; word < g_num_threads / 64; word++) {
+    auto slots = g_slots[word].load();
+
+    while (~slots != 0) {
+      auto bit = __builtin_ctzll(~slots);
+
+      if (g_slots[word].compare_exchange_weak(slots,
+                                              slots | (UINT64_C(1) << bit))) {
+        auto slot = word * 64 + bit;
+        pthread_setspecific(g_slot_key,
+                            reinterpret_cast<void *>(std::intptr_t{slot} + 1));
+        return slot;
+      }
+    }
+  }
+
+  return NO_SLOT;
+}
+
+// A child inherits the heap but only the thread that forked. No lock may be
+// held by the others then. Their slots stay taken in the child, as their
+// caches may have been half way through a change.
+void lock_for_fork() { g_sheap->lock_for_fork(); }
+void unlock_after_fork() { g_sheap->unlock_after_fork(); }
+
+// Set on the thread building the heap, whose own allocations meanwhile are
+// served by mappings rather than wait for themselves.
+thread_local bool t_initializing __attribute__((tls_model("initial-exec"))) =
+    false;
+
+void init() {
+  int state = UNINITIALIZED;
+
+  if (t_initializing)
+    return;
+
+  if (!g_state.compare_exchange_strong(state, INITIALIZING)) {
+    while (g_state.load() == INITIALIZING)
+      sched_yield();
+    return;
+  }
+  t_initializing = true;
+
+  auto size = env_or("SHEAP_MALLOC_SIZE", DEFAULT_SIZE);
+  auto num_threads = static_cast<int>(
+      env_or("SHEAP_MALLOC_THREADS", DEFAULT_THREADS));
+  num_threads = sheap::detail::next_pow_2(num_threads);
+  g_num_threads = std::min(std::max(num_threads, 64), MAX_THREADS);
+
+  auto mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (mem == MAP_FAILED || pthread_key_create(&g_slot_key, release_slot)) {
+    t_initializing = false;
+    g_state = FAILED;
+    return;
+  }
+
+  // The mapping is fresh, hence zero, which spares calloc() clearing most
+  // objects.
+  auto dflt = sheap::config{g_num_threads};
+  g_sheap = new (g_sheap_storage) sheap::Sheap{
+      mem, size,
+      sheap::config{g_num_threads, dflt.page_size, dflt.num_heaps, 1, 0,
+                    true}};
+  pthread_atfork(lock_for_fork, unlock_after_fork, unlock_after_fork);
+  t_initializing = false;
+  g_state = READY;
+}
+
+inline bool ready() {
+  if (BOOST_LIKELY(g_state.load(std::memory_order_acquire) == READY))
+    return true;
+
+  init();
+  return g_state.load(std::memory_order_acquire) == READY;
+}
+
+inline int get_tid() {
+  if (BOOST_LIKELY(t_tid >= 0))
+    return t_tid;
+
+  if (t_tid == NO_SLOT)
+    t_tid = acquire_slot();
+
+  return t_tid;
+}
+
+// Mappings for everything Sheap cannot serve. The header right below the
+// returned pointer records the mapping.
+struct large_header {
+  void *base;
+  std::size_t length;
+};
+
+void *large_alloc(std::size_t size, std::size_t align) {
+  static const std::size_t os_page_size = sysconf(_SC_PAGESIZE);
+  align = std::max(align, MIN_ALIGN);
+
+  // Room for the header and the alignment padding, rounded up to whole
+  // pages, must not wrap around.
+  std::size_t length;
+  if (align > SIZE_MAX / 2 ||
+      __builtin_add_overflow(
+          size, align + sizeof(large_header) + os_page_size - 1, &length)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  length = boost::alignment::align_down(length, os_page_size);
+  auto base = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (base == MAP_FAILED) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+
+  auto ptr = static_cast<char *>(boost::alignment::align_up(
+      static_cast<char *>(base) + sizeof(large_header), align));
+  new (ptr - sizeof(large_header)) large_header{base, length};
+  return ptr;
+}
+
+inline large_header *get_large_header(void *ptr) {
+  return reinterpret_cast<large_header *>(static_cast<char *>(ptr) -
+                                          sizeof(large_header));
+}
+
+inline bool is_sheap(const void *ptr) {
+  return g_sheap != nullptr && g_sheap->contains(ptr);
+}
+
+void *alloc(std::size_t size, std::size_t align) {
+  constexpr auto max_size = sheap::Sheap::max_alloc_size();
+  if (ready() && align <= max_size && size <= max_size - align) {
+    if (auto tid = get_tid(); tid >= 0) {
+      auto ptr = align <= MIN_ALIGN ? g_sheap->alloc(tid, size)
+                                    : g_sheap->aligned_alloc(tid, size, align);
+      if (ptr)
+        return ptr;
+    }
+  }
+
+  return large_alloc(size, align);
+}
+
+// Like alloc(size, MIN_ALIGN), zeroed. Fresh mappings are already zero.
+void *alloc_zeroed(std::size_t size) {
+  if (ready() && size <= sheap::Sheap::max_alloc_size()) {
+    if (auto tid = get_tid(); tid >= 0) {
+      if (auto ptr = g_sheap->calloc(tid, size))
+        return ptr;
+    }
+  }
+
+  return large_alloc(size, MIN_ALIGN);
+}
+
+std::size_t usable_size(void *ptr) {
+  if (is_sheap(ptr))
+    return g_sheap->usable_size(ptr);
+
+  auto hdr = get_large_header(ptr);
+  return static_cast<char *>(hdr->base) + hdr->length -
+         static_cast<char *>(ptr);
+}
+} // namespace
+
+SHEAP_EXPORT void *malloc(std::size_t size) {
+  auto ptr = alloc(size, MIN_ALIGN);
+  if (ptr == nullptr)
+    errno = ENOMEM;
+  return ptr;
+}
+
+SHEAP_EXPORT void free(void *ptr) {
+  if (ptr == nullptr)
+    return;
+
+  if (is_sheap(ptr)) {
+    if (t_tid >= 0) {
+      g_sheap->free(t_tid, ptr);
+    } else {
+      g_sheap->free(ptr);
+    }
+  } else {
+    auto hdr = get_large_header(ptr);
+    munmap(hdr->base, hdr->length);
+  }
+}
+
+SHEAP_EXPORT void *calloc(std::size_t n, std::size_t size) {
+  std::size_t total;
+
+  if (__builtin_mul_overflow(n, size, &total)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+
+  auto ptr = alloc_zeroed(total);
+  if (ptr == nullptr)
+    errno = ENOMEM;
+  return ptr;
+}
+
+SHEAP_EXPORT void *realloc(void *ptr, std::size_t size) {
+  if (ptr == nullptr)
+    return malloc(size);
+
+  if (size == 0) {
+    free(ptr);
+    return nullptr;
+  }
+
+  auto old_size = usable_size(ptr);
+  if (size <= old_size && (is_sheap(ptr) || size > old_size / 2))
+    return ptr;
+
+  auto new_ptr = malloc(size);
+  if (new_ptr) {
+    std::memcpy(new_ptr, ptr, std::min(size, old_size));
+    free(ptr);
+  }
+
+  return new_ptr;
+}
+
+SHEAP_EXPORT void *reallocarray(void *ptr, std::size_t n, std::size_t size) {
+  std::size_t total;
+
+  if (__builtin_mul_overflow(n, size, &total)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+
+  return realloc(ptr, total);
+}
+
+SHEAP_EXPORT int posix_memalign(void **res, std::size_t align,
+                                std::size_t size) {
+  if (align < sizeof(void *) || !sheap::detail::is_pow2(align))
+    return EINVAL;
+
+  auto ptr = alloc(size, align);
+  if (ptr == nullptr)
+    return ENOMEM;
+
+  *res = ptr;
+  return 0;
+}
+
+SHEAP_EXPORT void *aligned_alloc(std::size_t align, std::size_t size) {
+  if (align == 0 || !sheap::detail::is_pow2(align)) {
+    errno = EINVAL;
+    return nullptr;
+  }
+
+  auto ptr = alloc(size, align);
+  if (ptr == nullptr)
+    errno = ENOMEM;
+  return ptr;
+}
+
+SHEAP_EXPORT void *memalign(std::size_t align, std::size_t size) {
+  return aligned_alloc(align, size);
+}
+
+SHEAP_EXPORT void *valloc(std::size_t size) {
+  return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+SHEAP_EXPORT void *pvalloc(std::size_t size) {
+  static const std::size_t os_page_size = sysconf(_SC_PAGESIZE);
+  if (size > SIZE_MAX - os_page_size) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  return aligned_alloc(os_page_size,
+                       boost::alignment::align_up(size, os_page_size));
+}
+
+SHEAP_EXPORT std::size_t malloc_usable_size(void *ptr) {
+  return ptr ? usable_size(ptr) : 0;
+}
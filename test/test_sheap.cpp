@@ -1,13 +1,28 @@
+#include "sheap/Arena.h"
 #include "sheap/Sheap.h"
+#if __has_include(<sys/mman.h>)
+#include "sheap/Segment.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <system_error>
+#include <unistd.h>
+#endif
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <boost/align/is_aligned.hpp>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <doctest/doctest.h>
+#include <list>
+#include <map>
 #include <memory>
 #include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 #include <thread>
 #include <unordered_set>
 #include <utility>
@@ -117,6 +132,1190 @@ TEST_CASE("SheapAlignedAlloc") {
   sheap.collect_garbage<sheap::flush_cache<true>>(1);
 }
 
+TEST_CASE("SheapPageOrders") {
+  constexpr auto MAX_MEMORY = 4'000'000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{1, 4096, 1};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+  std::vector<void *> ptrs;
+
+  auto fill = [&](std::size_t size) {
+    while (auto ptr = sheap.alloc(0, size)) {
+      clobber(ptr, size);
+      ptrs.push_back(ptr);
+    }
+
+    auto alloced = ptrs.size() * size;
+    for (auto ptr : ptrs) {
+      sheap.free(ptr);
+    }
+    ptrs.clear();
+    sheap.flush_thread_cache(0);
+    sheap.collect_garbage_full();
+
+    return alloced;
+  };
+
+  // Pages of large bins span several base pages; once released they must be
+  // split up again for bins that use a single base page, and merged back
+  // once those are released in turn.
+  auto large = fill(4096);
+  auto small = fill(16);
+  REQUIRE(large > MAX_MEMORY / 2);
+  REQUIRE(small > large / 2);
+  REQUIRE(fill(4096) == large);
+  REQUIRE(fill(16) == small);
+}
+
+TEST_CASE("SheapSizedFree") {
+  constexpr auto MAX_MEMORY = 4'000'000;
+  constexpr auto NUM_ALLOC = 5000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{1};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+
+  struct Node {
+    Node *next;
+    std::size_t val;
+  };
+
+  auto pool = sheap::pool<Node>{sheap, 0};
+  Node *head = nullptr;
+
+  for (std::size_t i = 0; i < NUM_ALLOC; i++) {
+    head = pool.new_object(Node{head, i});
+    REQUIRE(head != nullptr);
+  }
+
+  for (auto i = NUM_ALLOC; head; i--) {
+    REQUIRE(head->val == static_cast<std::size_t>(i - 1));
+    pool.delete_object(std::exchange(head, head->next));
+  }
+
+  for (std::size_t size = 1; size <= sheap.max_alloc_size(); size *= 3) {
+    auto ptr = sheap.alloc(0, size);
+    REQUIRE(ptr != nullptr);
+    clobber(ptr, size);
+    sheap.free_sized(ptr, size);
+  }
+
+  // Node based containers allocate through the sized path.
+  std::list<int, sheap::pool<int>> list{sheap::pool<int>{sheap, 0}};
+  for (auto i = 0; i < NUM_ALLOC; i++) {
+    list.push_back(i);
+  }
+  list.clear();
+
+  sheap.collect_garbage_full();
+}
+
+TEST_CASE("SheapUsableSize") {
+  constexpr auto MAX_MEMORY = 32'000'000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{1};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+
+  for (std::size_t size = 1; size <= sheap.max_alloc_size(); size += 97) {
+    auto ptr = static_cast<char *>(sheap.alloc(0, size));
+    REQUIRE(ptr != nullptr);
+    REQUIRE(sheap.contains(ptr));
+    REQUIRE(sheap.usable_size(ptr) >= size);
+    clobber(ptr, sheap.usable_size(ptr));
+    sheap.free(ptr);
+  }
+
+  auto ptr = static_cast<char *>(sheap.aligned_alloc(0, 100, 256));
+  REQUIRE(sheap.usable_size(ptr) >= 100);
+  clobber(ptr, sheap.usable_size(ptr));
+  sheap.free(ptr);
+
+  REQUIRE_FALSE(sheap.contains(&sheap));
+  REQUIRE_FALSE(sheap.contains(mem.get() + MAX_MEMORY));
+}
+
+TEST_CASE("SheapCalloc") {
+  constexpr auto MAX_MEMORY = 8'000'000;
+  constexpr auto NUM_ALLOC = 3000;
+  auto is_zero = [](const void *ptr, std::size_t size) {
+    auto p = static_cast<const char *>(ptr);
+    return std::all_of(p, p + size, [](char c) { return c == 0; });
+  };
+
+  {
+    auto mem = mem_alloc<MAX_MEMORY>();
+    auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, sheap::config{1}};
+    for (std::size_t size = 1; size <= sheap.max_alloc_size(); size += 97) {
+      auto ptr = sheap.calloc(0, size);
+      REQUIRE(ptr != nullptr);
+      REQUIRE(is_zero(ptr, size));
+      sheap.free(ptr);
+    }
+  }
+
+  // Objects off pages never used are taken as they are, which memory that
+  // is not zero, though said to be, gives away.
+  auto zeroed = sheap::config{1, 8 * 1024, 1, 1, 0, true};
+  {
+    auto mem = mem_alloc<MAX_MEMORY>();
+    auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, zeroed};
+    REQUIRE(sheap.alloc(0, 64) != nullptr);
+    REQUIRE_FALSE(is_zero(sheap.calloc(0, 64), 64));
+  }
+
+  // Objects reused, or on pages reused for another size class, are cleared.
+  auto mem = std::make_unique<std::array<char, MAX_MEMORY>>();
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, zeroed};
+  std::vector<void *> ptrs;
+
+  for (auto size : {48, 48, 200}) {
+    for (int i = 0; i < NUM_ALLOC; i++) {
+      auto ptr = sheap.calloc(0, size);
+      REQUIRE(ptr != nullptr);
+      REQUIRE(is_zero(ptr, size));
+      clobber(ptr, size);
+      ptrs.push_back(ptr);
+    }
+
+    for (auto ptr : ptrs)
+      sheap.free(ptr);
+    ptrs.clear();
+    sheap.flush_thread_cache(0);
+    sheap.collect_garbage(0);
+  }
+}
+
+TEST_CASE("SheapStealPages") {
+  constexpr auto MAX_MEMORY = 4'000'000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{2, 8 * 1024, 2};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+
+  auto fill = [&](int tid, std::size_t size) {
+    std::vector<void *> ptrs;
+    while (auto ptr = sheap.alloc(tid, size))
+      ptrs.push_back(ptr);
+    return ptrs;
+  };
+
+  // Pages emptied by heap 0, whether cached by it or still waiting for their
+  // frees to be applied, are all usable by heap 1.
+  auto ptrs = fill(0, 1000);
+  REQUIRE(!ptrs.empty());
+  for (std::size_t i = 0; i < ptrs.size(); i++) {
+    sheap.free(ptrs[i]);
+    if (i == ptrs.size() / 2)
+      sheap.collect_garbage(0);
+  }
+
+  auto stolen = fill(1, 1000);
+  REQUIRE(stolen.size() >= ptrs.size());
+
+  // Heap 0 is left with nothing but can still borrow heap 1's free slots.
+  for (std::size_t i = 0; i < stolen.size(); i += 2)
+    sheap.free(stolen[i]);
+  sheap.collect_garbage(1);
+
+  auto borrowed = fill(0, 1000);
+  REQUIRE(borrowed.size() >= stolen.size() / 2);
+
+  for (auto ptr : borrowed)
+    sheap.free(ptr);
+  for (std::size_t i = 1; i < stolen.size(); i += 2)
+    sheap.free(stolen[i]);
+  sheap.collect_garbage_full();
+  auto refilled = fill(1, 1000);
+  REQUIRE(refilled.size() >= ptrs.size());
+
+  // Pages heap 0 used for a small bin, freed but never collected, are merged
+  // back into runs that the largest bin of heap 1 can use.
+  constexpr auto LARGE = sheap::Sheap::max_alloc_size();
+  for (auto ptr : refilled)
+    sheap.free(ptr);
+  sheap.collect_garbage_full();
+  auto large = fill(1, LARGE);
+  REQUIRE(large.size() * LARGE > MAX_MEMORY / 2);
+  for (auto ptr : large)
+    sheap.free(ptr);
+  sheap.collect_garbage_full();
+
+  for (auto ptr : fill(0, 16))
+    sheap.free(ptr);
+  REQUIRE(fill(1, LARGE).size() + 1 >= large.size());
+}
+
+TEST_CASE("SheapTenants") {
+  constexpr auto MAX_MEMORY = 32'000'000;
+  constexpr std::size_t QUOTA = 1024 * 1024;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{1, 8 * 1024, 2, 3};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+
+  auto hard = sheap.create_tenant("hard", QUOTA);
+  auto soft = sheap.create_tenant("soft", QUOTA, false);
+  REQUIRE(hard > 0);
+  REQUIRE(soft > 0);
+  REQUIRE(sheap.create_tenant("hard") == -1);
+  REQUIRE(sheap.create_tenant("third") == -1);
+  REQUIRE(sheap.find_tenant("soft") == soft);
+  REQUIRE(sheap.find_tenant("none") == -1);
+
+  std::vector<void *> ptrs;
+  while (auto ptr = sheap.alloc(hard, 0, 1000))
+    ptrs.push_back(ptr);
+  REQUIRE(sheap.tenant_usage(hard) <= QUOTA);
+  REQUIRE(ptrs.size() * 1000 >= QUOTA / 2);
+  REQUIRE(sheap.alloc(0, 1000) != nullptr);
+
+  // Freed memory is reclaimed by the tenant once it hits its quota.
+  for (auto ptr : ptrs)
+    sheap.free(ptr);
+  ptrs.clear();
+  for (int i = 0; i < 500; i++) {
+    auto ptr = sheap.alloc(hard, 0, 1000);
+    REQUIRE(ptr != nullptr);
+    ptrs.push_back(ptr);
+  }
+  for (auto ptr : ptrs)
+    sheap.free(0, ptr);
+  sheap.flush_thread_cache(0);
+  sheap.collect_garbage_full();
+  // Only the pages of the thread cache remain.
+  REQUIRE(sheap.tenant_usage(hard) <= 64 * 1024);
+
+  for (int i = 0; i < 2000; i++)
+    REQUIRE(sheap.alloc(soft, 0, 1000) != nullptr);
+  REQUIRE(sheap.tenant_usage(soft) > QUOTA);
+
+  // Racing creates of the same name make a single tenant.
+  constexpr int NUM_THREADS = 8;
+  constexpr int NUM_NAMES = 15;
+  auto racy_config = sheap::config{1, 8 * 1024, 1, NUM_NAMES + 1};
+  auto racy = sheap::Sheap{mem.get(), MAX_MEMORY, racy_config};
+  std::atomic<int> created[NUM_NAMES] = {};
+  std::atomic<int> ready = 0;
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < NUM_THREADS; t++) {
+    threads.emplace_back([&]() {
+      for (int i = 0; i < NUM_NAMES; i++) {
+        auto name = std::to_string(i);
+        ready++;
+        while (ready < NUM_THREADS * (i + 1))
+          std::this_thread::yield();
+        if (racy.create_tenant(name.c_str()) > 0)
+          created[i]++;
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  for (auto &count : created)
+    REQUIRE(count == 1);
+}
+
+TEST_CASE("SheapReserve") {
+  constexpr auto MAX_MEMORY = 8'000'000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{2};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+
+  REQUIRE(sheap.available(0, 64) == 0);
+  auto reserved = sheap.reserve(0, 64, 10000);
+  REQUIRE(reserved >= 10000);
+  REQUIRE(sheap.available(0, 64) == reserved);
+  REQUIRE(sheap.available(1, 64) == 0);
+  REQUIRE(sheap.reserve(0, 64, 10) == reserved);
+
+  for (int i = 0; i < 10000; i++) {
+    auto ptr = sheap.alloc(0, 64);
+    REQUIRE(ptr != nullptr);
+    clobber(ptr, 64);
+  }
+  REQUIRE(sheap.available(0, 64) == reserved - 10000);
+
+  // Short of what was asked once the heap runs out.
+  auto all = sheap.reserve(1, 1024, MAX_MEMORY);
+  REQUIRE(all > 0);
+  REQUIRE(all < MAX_MEMORY / 1024);
+  REQUIRE(sheap.alloc(0, 1024) == nullptr);
+}
+
+TEST_CASE("SheapTryAlloc") {
+  constexpr auto MAX_MEMORY = 4'000'000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{2};
+  std::vector<void *> live;
+
+  {
+    auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+    auto error = sheap::alloc_error::NONE;
+
+    while (auto ptr = sheap.try_alloc(0, 1024, &error)) {
+      clobber(ptr, 1024);
+      live.push_back(ptr);
+    }
+    REQUIRE(error == sheap::alloc_error::NO_MEMORY);
+    REQUIRE(live.size() > MAX_MEMORY / 1024 / 2);
+
+    // Remote frees wait for a locking path to apply them.
+    for (auto ptr : live)
+      sheap.free(ptr);
+    REQUIRE(sheap.try_alloc(0, 1024) == nullptr);
+    sheap.collect_garbage();
+    REQUIRE(sheap.try_alloc(0, 1024) != nullptr);
+  }
+
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+  sheap.set_quota(0, 64 * 1024);
+  auto error = sheap::alloc_error::NONE;
+  std::size_t num_allocs = 0;
+
+  while (sheap.try_alloc(1, 64, &error) != nullptr)
+    num_allocs++;
+  REQUIRE(error == sheap::alloc_error::OVER_QUOTA);
+  REQUIRE(num_allocs > 0);
+  REQUIRE(num_allocs <= 64 * 1024 / 64);
+}
+
+TEST_CASE("SheapPartialPageOrder") {
+  constexpr auto MAX_MEMORY = 32'000'000;
+  constexpr auto PAGE_SIZE = 8 * 1024;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{2, PAGE_SIZE, 1};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+
+  // 128 objects to a page; all but the last few pages end up full on the
+  // heap's lists.
+  std::map<std::uintptr_t, std::vector<void *>> pages;
+  for (int i = 0; i < 10000; i++) {
+    auto ptr = sheap.alloc(0, 64);
+    REQUIRE(ptr != nullptr);
+    pages[reinterpret_cast<std::uintptr_t>(ptr) / PAGE_SIZE].push_back(ptr);
+  }
+  REQUIRE(sheap.stats().num_partial_pages == 0);
+  REQUIRE(sheap.stats().free_bytes == 0);
+
+  // One sparse page, freed first, then 60 nearly full ones.
+  auto it = pages.begin();
+  auto sparse = it->first;
+  for (auto ptr : it->second)
+    if (ptr != it->second.back())
+      sheap.free(ptr);
+  for (int i = 0; i < 60; i++)
+    sheap.free((++it)->second.back());
+
+  auto st = sheap.stats();
+  REQUIRE(st.num_partial_pages == 61);
+  REQUIRE(st.free_bytes == (127 + 60) * 64);
+  REQUIRE(st.fragmentation() > 0);
+
+  // Refills take the fullest pages, leaving the sparse one to drain.
+  for (int i = 0; i < 60; i++) {
+    auto ptr = sheap.alloc(1, 64);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(ptr) / PAGE_SIZE != sparse);
+  }
+  sheap.free(pages.begin()->second.back());
+  REQUIRE(sheap.stats().num_partial_pages == 0);
+}
+
+TEST_CASE("SheapRegions") {
+  constexpr auto MAX_MEMORY = 2'000'000;
+  constexpr auto REGION_SIZE = 40'000'000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto region = std::make_unique<char[]>(REGION_SIZE);
+  auto config = sheap::config{2};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+  std::vector<void *> live;
+
+  while (auto ptr = sheap.alloc(0, 1024))
+    live.push_back(ptr);
+  auto in_heap = live.size();
+
+  REQUIRE(sheap.add_region(region.get(), REGION_SIZE));
+  for (int i = 0; i < 20000; i++) {
+    auto ptr = sheap.alloc(i % 2, 64 + i % 2048);
+    REQUIRE(ptr != nullptr);
+    REQUIRE(sheap.contains(ptr));
+    clobber(ptr, 64 + i % 2048);
+    live.push_back(ptr);
+  }
+  REQUIRE(sheap.release_empty_regions([](void *, std::size_t) {}) == 0);
+
+  // Partly used region memory stays; once freed, the region is given back.
+  for (auto ptr : live)
+    sheap.free(ptr);
+  sheap.flush_thread_cache(0);
+  sheap.flush_thread_cache(1);
+
+  std::vector<std::pair<void *, std::size_t>> released;
+  REQUIRE(sheap.release_empty_regions([&](void *mem, std::size_t size) {
+    released.emplace_back(mem, size);
+  }) == 1);
+  REQUIRE(released.size() == 1);
+  REQUIRE(released[0].first == region.get());
+  REQUIRE(released[0].second == REGION_SIZE);
+  REQUIRE_FALSE(sheap.contains(region.get() + REGION_SIZE / 2));
+
+  live.clear();
+  while (auto ptr = sheap.alloc(0, 1024))
+    live.push_back(ptr);
+  REQUIRE(live.size() >= in_heap);
+  for (auto ptr : live)
+    REQUIRE(!(ptr >= region.get() && ptr < region.get() + REGION_SIZE));
+}
+
+TEST_CASE("SheapEpoch") {
+  constexpr auto MAX_MEMORY = 16'000'000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{4};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+  auto is_live = [](sheap::Sheap &heap, void *ptr) {
+    bool found = false;
+    heap.walk([&](void *obj, std::size_t) { found |= obj == ptr; }, true);
+    return found;
+  };
+
+  auto ptr = sheap.alloc(0, 64);
+  {
+    sheap::epoch_guard reader{sheap, 1};
+    sheap::epoch_guard nested{sheap, 1};
+    sheap.retire(0, ptr);
+    for (int i = 0; i < 10; i++)
+      sheap.epoch_collect(0);
+    REQUIRE(is_live(sheap, ptr));
+  }
+  for (int i = 0; i < 3; i++)
+    sheap.epoch_collect(0);
+  REQUIRE_FALSE(is_live(sheap, ptr));
+
+  // With nobody pinned, retiring frees earlier batches by itself.
+  for (int i = 0; i < 1000; i++)
+    sheap.retire(0, sheap.alloc(0, 32));
+  std::size_t num_live = 0;
+  sheap.walk([&](void *, std::size_t) { num_live++; }, true);
+  REQUIRE(num_live < 256);
+
+#if __has_include(<sys/mman.h>)
+  // A reader whose process died while pinned holds nobody back.
+  auto name = "sheap_epoch_" + std::to_string(getpid());
+  auto seg = sheap::segment::create(name, MAX_MEMORY, config);
+  sheap::segment::remove(name);
+
+  auto pid = fork();
+  if (pid == 0) {
+    seg.heap().epoch_enter(1);
+    _exit(0);
+  }
+  REQUIRE(waitpid(pid, nullptr, 0) == pid);
+
+  ptr = seg.heap().alloc(0, 64);
+  seg.heap().retire(0, ptr);
+  for (int i = 0; i < 3; i++)
+    seg.heap().epoch_collect(0);
+  REQUIRE_FALSE(is_live(seg.heap(), ptr));
+
+  // Its slot, taken over by another reader, is pinned afresh.
+  pid = fork();
+  if (pid == 0) {
+    seg.heap().epoch_enter(2);
+    _exit(0);
+  }
+  REQUIRE(waitpid(pid, nullptr, 0) == pid);
+
+  ptr = seg.heap().alloc(0, 64);
+  {
+    sheap::epoch_guard reader{seg.heap(), 2};
+    seg.heap().retire(0, ptr);
+    for (int i = 0; i < 10; i++)
+      seg.heap().epoch_collect(0);
+    REQUIRE(is_live(seg.heap(), ptr));
+  }
+  for (int i = 0; i < 3; i++)
+    seg.heap().epoch_collect(0);
+  REQUIRE_FALSE(is_live(seg.heap(), ptr));
+#endif
+}
+
+TEST_CASE("SheapArena") {
+  constexpr auto MAX_MEMORY = 16'000'000;
+  constexpr std::size_t PAGE_SIZE = 8 * 1024;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{4, PAGE_SIZE, 4};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+  auto usage = sheap.tenant_usage(0);
+
+  {
+    sheap::arena arena{sheap, 0};
+
+    for (int i = 0; i < 1000; i++) {
+      auto size = 1 + i * 7 % 200;
+      std::size_t align = 1 << i % 8;
+      auto ptr = arena.alloc(size, align);
+      REQUIRE(ptr != nullptr);
+      REQUIRE(boost::alignment::is_aligned(ptr, align));
+      clobber(ptr, size);
+    }
+    auto capacity = arena.capacity();
+    REQUIRE(capacity >= 1000);
+    REQUIRE(sheap.tenant_usage(0) == usage + capacity);
+
+    // A scope frees what it allocated, and any pages it took, on exit.
+    {
+      sheap::arena::scope outer{arena};
+      REQUIRE(arena.alloc(100) != nullptr);
+      {
+        sheap::arena::scope inner{arena};
+        auto big = arena.alloc(3 * PAGE_SIZE, 4 * PAGE_SIZE);
+        REQUIRE(big != nullptr);
+        REQUIRE(boost::alignment::is_aligned(big, 4 * PAGE_SIZE));
+        clobber(big, 3 * PAGE_SIZE);
+        REQUIRE(arena.capacity() > capacity);
+      }
+      REQUIRE(arena.capacity() <= capacity + PAGE_SIZE);
+    }
+    REQUIRE(arena.capacity() == capacity);
+
+    REQUIRE(arena.construct<std::pair<int, double>>(1, 2.0)->second == 2.0);
+    REQUIRE(arena.alloc(std::size_t{1} << 40) == nullptr);
+
+    arena.reset();
+    REQUIRE(arena.capacity() == PAGE_SIZE);
+  }
+
+  REQUIRE(sheap.tenant_usage(0) == usage);
+}
+
+TEST_CASE("SheapAllocWait") {
+  using namespace std::chrono_literals;
+  constexpr auto MAX_MEMORY = 4'000'000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{4};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+  constexpr std::size_t SIZE = 4000;
+
+  std::vector<void *> objs;
+  while (auto ptr = sheap.alloc(0, SIZE))
+    objs.push_back(ptr);
+  REQUIRE(!objs.empty());
+  REQUIRE(sheap.alloc_wait(0, SIZE, 5ms) == nullptr);
+  // Frees to pages of a thread cache could only be reused by its thread.
+  sheap.flush_thread_cache(0);
+
+  // Two producers wait until a consumer frees, one object at a time.
+  std::atomic<int> num_done = 0;
+  std::vector<std::thread> producers;
+  for (int tid = 1; tid <= 2; tid++) {
+    producers.emplace_back([&, tid] {
+      for (int i = 0; i < 10; i++) {
+        auto ptr = sheap.alloc_wait(tid, SIZE, 10s);
+        REQUIRE(ptr != nullptr);
+        clobber(ptr, SIZE);
+        num_done++;
+      }
+      sheap.flush_thread_cache(tid);
+    });
+  }
+
+  std::this_thread::sleep_for(5ms);
+  REQUIRE(num_done == 0);
+  for (int i = 0; i < 20; i++)
+    sheap.free(objs[i]);
+  for (auto &producer : producers)
+    producer.join();
+  REQUIRE(num_done == 20);
+
+  // Past WaitQueue::MAX_WAITERS, waiters are turned away rather than wait.
+  constexpr int NUM_WAITERS = 1024 + 64;
+  auto crowded_mem = mem_alloc<16 * MAX_MEMORY>();
+  auto crowded_config = sheap::config{2048};
+  auto crowded =
+      sheap::Sheap{crowded_mem.get(), 16 * MAX_MEMORY, crowded_config};
+  while (crowded.alloc(0, SIZE) != nullptr) {
+  }
+
+  std::atomic<int> num_refused = 0;
+  std::vector<std::thread> waiters;
+  for (int tid = 1; tid <= NUM_WAITERS; tid++) {
+    waiters.emplace_back([&, tid] {
+      auto start = std::chrono::steady_clock::now();
+      REQUIRE(crowded.alloc_wait(tid, SIZE, 2s) == nullptr);
+      if (std::chrono::steady_clock::now() - start < 1s)
+        num_refused++;
+    });
+  }
+  for (auto &waiter : waiters)
+    waiter.join();
+  REQUIRE(num_refused > 0);
+  REQUIRE(num_refused <= NUM_WAITERS - 1024);
+}
+
+TEST_CASE("SheapAllocNear") {
+  constexpr auto MAX_MEMORY = 16'000'000;
+  constexpr std::size_t PAGE_SIZE = 8 * 1024;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{4, PAGE_SIZE, 4};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+  auto page_of = [&](const void *ptr) {
+    return reinterpret_cast<std::uintptr_t>(ptr) / PAGE_SIZE;
+  };
+
+  std::vector<void *> objs;
+  for (int i = 0; i < 2000; i++)
+    objs.push_back(sheap.alloc(0, 64));
+
+  // Make room on the page of objs[0], which goes back to its heap.
+  sheap.flush_thread_cache(0);
+  for (int i = 1; i < 2000 && page_of(objs[i]) == page_of(objs[0]); i += 2)
+    sheap.free(objs[i]);
+  sheap.collect_garbage();
+
+  auto near = sheap.alloc_near(1, 64, objs[0]);
+  REQUIRE(page_of(near) == page_of(objs[0]));
+
+  // Otherwise the thread's page closest to it.
+  auto far = sheap.alloc(2, 64);
+  for (int i = 0; i < 100; i++) {
+    auto ptr = sheap.alloc_near(2, 64, far);
+    REQUIRE(ptr != nullptr);
+    REQUIRE(page_of(ptr) == page_of(far));
+  }
+
+  REQUIRE(sheap.alloc_near(1, 3000, objs[0]) != nullptr);
+  REQUIRE(sheap.alloc_near(1, 64, nullptr) != nullptr);
+}
+
+TEST_CASE("SheapHandles") {
+  constexpr auto MAX_MEMORY = 16'000'000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{4, 8 * 1024, 4};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+
+  std::vector<sheap::handle> handles;
+  for (int i = 0; i < 2000; i++) {
+    auto h = sheap.alloc_handle(0, 64);
+    REQUIRE(h != sheap::handle{});
+    *sheap::pinned<int>(sheap, h) = i;
+    handles.push_back(h);
+  }
+  sheap.flush_thread_cache(0);
+
+  // Leave every page sparse, with one object pinned.
+  std::vector<std::pair<sheap::handle, int>> live;
+  for (int i = 0; i < 2000; i++) {
+    if (i % 16 == 0) {
+      live.emplace_back(handles[i], i);
+    } else {
+      sheap.free_handle(handles[i]);
+    }
+  }
+  sheap.collect_garbage_full();
+  auto usage = sheap.tenant_usage(0);
+
+  std::vector<void *> before;
+  for (auto [h, i] : live) {
+    before.push_back(sheap.pin(h));
+    sheap.unpin(h);
+  }
+
+  std::size_t moved = 0;
+  {
+    sheap::pinned<int> pin{sheap, live[0].first};
+    moved = sheap.compact(1);
+    REQUIRE(pin.get() == before[0]);
+  }
+  REQUIRE(moved == live.size() - 1);
+
+  for (std::size_t i = 0; i < live.size(); i++) {
+    sheap::pinned<int> obj{sheap, live[i].first};
+    REQUIRE(*obj == live[i].second);
+    REQUIRE((obj.get() == before[i]) == (i == 0));
+  }
+
+  sheap.collect_garbage_full();
+  REQUIRE(sheap.tenant_usage(0) < usage);
+
+  // Handles of freed objects are not reused as is.
+  sheap.free_handle(live[1].first);
+  auto h = sheap.alloc_handle(0, 64);
+  REQUIRE(h != live[1].first);
+  sheap.free_handle(h);
+}
+
+TEST_CASE("SheapTransferCache") {
+  constexpr auto MAX_MEMORY = 32'000'000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{2};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+  std::unordered_set<void *> freed;
+  std::unordered_set<void *> live;
+
+  // Thread 0 produces, thread 1 consumes: all but the consumer's last
+  // batches come back to the producer without passing through the pages.
+  for (int i = 0; i < 1000; i++) {
+    auto ptr = sheap.alloc(0, 64);
+    REQUIRE(ptr != nullptr);
+    clobber(ptr, 64);
+    freed.insert(ptr);
+  }
+  for (auto ptr : freed)
+    sheap.free(1, ptr);
+
+  int reused = 0;
+  for (int i = 0; i < 1000; i++) {
+    auto ptr = sheap.alloc(0, 64);
+    REQUIRE(ptr != nullptr);
+    REQUIRE(live.insert(ptr).second);
+    clobber(ptr, 64);
+    reused += freed.count(ptr);
+  }
+  REQUIRE(reused >= 900);
+
+  std::size_t seen = 0;
+  sheap.walk(
+      [&](void *ptr, std::size_t) {
+        REQUIRE(live.count(ptr) == 1);
+        seen++;
+      },
+      true);
+  REQUIRE(seen == live.size());
+
+  for (auto ptr : live)
+    sheap.free(0, ptr);
+  sheap.flush_thread_cache(0);
+  sheap.flush_thread_cache(1);
+  sheap.collect_garbage_full();
+
+  seen = 0;
+  sheap.walk([&](void *, std::size_t) { seen++; }, true);
+  REQUIRE(seen == 0);
+}
+
+TEST_CASE("SheapWalk") {
+  constexpr auto MAX_MEMORY = 32'000'000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{4};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+  std::unordered_set<void *> live;
+
+  for (int i = 0; i < 5000; i++) {
+    auto size = 8 + i * 13 % 3000;
+    auto ptr = sheap.alloc(i % 4, size);
+    REQUIRE(ptr != nullptr);
+
+    if (i % 3 == 0) {
+      sheap.free(ptr);
+    } else {
+      live.insert(ptr);
+    }
+  }
+
+  std::unordered_set<void *> seen;
+  sheap.walk(
+      [&](void *ptr, std::size_t size) {
+        REQUIRE(size >= 8);
+        REQUIRE(seen.insert(ptr).second);
+      },
+      true);
+  REQUIRE(seen == live);
+
+  // Without `stopped`, objects kept by thread caches or not yet given back
+  // to their pages are left out too.
+  seen.clear();
+  sheap.walk([&](void *ptr, std::size_t) {
+    REQUIRE(seen.insert(ptr).second);
+  });
+  REQUIRE(seen == live);
+
+  // Objects allocated or freed meanwhile may or may not be seen.
+  std::atomic<bool> done = false;
+  auto churn = std::thread([&] {
+    std::vector<void *> ptrs;
+    while (!done) {
+      for (int i = 0; i < 1000; i++)
+        ptrs.push_back(sheap.alloc(1, 8 + i % 500));
+      for (auto ptr : ptrs)
+        sheap.free(ptr);
+      ptrs.clear();
+    }
+  });
+  for (int i = 0; i < 20; i++) {
+    seen.clear();
+    sheap.walk([&](void *ptr, std::size_t) {
+      REQUIRE(seen.insert(ptr).second);
+    });
+    for (auto ptr : live)
+      REQUIRE(seen.count(ptr) == 1);
+  }
+  done = true;
+  churn.join();
+
+  // The callback may use the heap, and may be called for what it allocated.
+  std::unordered_set<void *> scratch;
+  for (int tid = 0; tid < 4; tid++)
+    sheap.flush_thread_cache(tid);
+  sheap.collect_garbage_full();
+  seen.clear();
+  sheap.walk([&](void *ptr, std::size_t size) {
+    REQUIRE(live.count(ptr) + scratch.count(ptr) == 1);
+    REQUIRE(seen.insert(ptr).second);
+    auto tmp = sheap.alloc(0, size);
+    scratch.insert(tmp);
+    sheap.free(tmp);
+    if (seen.size() % 100 == 0)
+      sheap.collect_garbage_full();
+  });
+  for (auto ptr : live)
+    REQUIRE(seen.count(ptr) == 1);
+}
+
+#ifdef SHEAP_ENABLE_PROFILER
+TEST_CASE("SheapProfiler") {
+  constexpr auto MAX_MEMORY = 32'000'000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{1};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+  static const char tag[] = "SheapProfiler";
+  std::vector<void *> ptrs;
+
+  sheap.start_profiling(4096);
+  sheap::Sheap::set_profile_tag(tag);
+  for (int i = 0; i < 10000; i++) {
+    ptrs.push_back(sheap.alloc(0, 256));
+    REQUIRE(ptrs.back() != nullptr);
+  }
+  sheap::Sheap::set_profile_tag(nullptr);
+
+  std::ostringstream live;
+  sheap.dump_heap_profile(live);
+  REQUIRE(live.str().rfind("heap profile: ", 0) == 0);
+  REQUIRE(live.str().rfind("heap profile: 0:", 0) != 0);
+  REQUIRE(live.str().find("heap_v2/4096") != std::string::npos);
+
+  for (auto ptr : ptrs)
+    sheap.free(ptr);
+  sheap.stop_profiling();
+
+  std::ostringstream freed;
+  sheap.dump_heap_profile(freed);
+  REQUIRE(freed.str().rfind("heap profile: 0: 0 [", 0) == 0);
+}
+#endif
+
+TEST_CASE("SheapDirectory") {
+  constexpr auto MAX_MEMORY = 32'000'000;
+  constexpr auto NUM_THREADS = 4;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{NUM_THREADS};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+
+  struct queue {
+    int capacity;
+    std::atomic<int> users;
+  };
+
+  std::array<queue *, NUM_THREADS> found = {};
+  std::vector<std::thread> workers;
+  for (int i = 0; i < NUM_THREADS; i++) {
+    workers.emplace_back([&, i] {
+      found[i] = sheap.find_or_construct<queue>(i, "queue", 128, 0);
+      found[i]->users++;
+    });
+  }
+  for (auto &t : workers)
+    t.join();
+
+  for (auto q : found)
+    REQUIRE(q == found[0]);
+  REQUIRE(found[0]->capacity == 128);
+  REQUIRE(found[0]->users == NUM_THREADS);
+
+  REQUIRE(sheap.find<queue>("queue") == found[0]);
+  REQUIRE(sheap.find<char>("queue") == nullptr);
+  REQUIRE(sheap.find<queue>("stack") == nullptr);
+  REQUIRE(sheap.find_or_construct<int>(0, std::string(32, 'x'), 1) == nullptr);
+
+  auto reopened = sheap::Sheap{mem.get(), MAX_MEMORY, sheap::open_existing};
+  REQUIRE(reopened.find<queue>("queue") == found[0]);
+  reopened.close();
+
+  int made = 1;
+  for (int i = 0; i < 300; i++)
+    made += sheap.find_or_construct<int>(0, std::to_string(i), i) != nullptr;
+  REQUIRE(made == 256);
+  REQUIRE(*sheap.find<int>("42") == 42);
+}
+
+#if __has_include(<sys/mman.h>)
+TEST_CASE("SheapSegment") {
+  constexpr auto MAX_MEMORY = 16'000'000;
+  auto name = "sheap_test_" + std::to_string(getpid());
+  auto config = sheap::config{4};
+  void *base;
+
+  {
+    auto seg = sheap::segment::create(name, MAX_MEMORY, config);
+    base = seg.base();
+    REQUIRE(seg.size() == MAX_MEMORY);
+    REQUIRE(seg.heap().find_or_construct<int>(0, "answer", 42) != nullptr);
+
+    // The address it records is taken by this very mapping.
+    REQUIRE_THROWS_AS(sheap::segment::open(name), std::system_error);
+    REQUIRE_THROWS_AS(sheap::segment::create(name, MAX_MEMORY, config),
+                      std::system_error);
+  }
+
+  {
+    auto seg = sheap::segment::open(name);
+    REQUIRE(seg.base() == base);
+    REQUIRE_FALSE(seg.heap().needs_recovery());
+    REQUIRE(*seg.heap().find<int>("answer") == 42);
+
+    for (int i = 0; i < 1000; i++) {
+      auto ptr = seg.heap().alloc(i % 4, 16 + i);
+      REQUIRE(ptr != nullptr);
+      clobber(ptr, 16 + i);
+      seg.heap().free(ptr);
+    }
+  }
+
+#ifdef __linux__
+  // Opened by a process of its own, which maps the library elsewhere, see
+  // SheapSegmentChild.
+  auto pid = fork();
+  if (pid == 0) {
+    setenv("SHEAP_TEST_SEGMENT", name.c_str(), 1);
+    execl("/proc/self/exe", "test_sheap", "--test-case=SheapSegmentChild",
+          static_cast<char *>(nullptr));
+    _exit(127);
+  }
+
+  int status = 0;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE((WIFEXITED(status) && WEXITSTATUS(status) == 0));
+#endif
+
+  sheap::segment::remove(name);
+  REQUIRE_THROWS_AS(sheap::segment::open(name), std::system_error);
+
+  // Too small for the heap: the failed create leaves no segment behind.
+  REQUIRE_THROWS_AS(sheap::segment::create(name, 8192, config),
+                    std::bad_alloc);
+  sheap::segment::create(name, MAX_MEMORY, config);
+  sheap::segment::remove(name);
+
+#ifdef __linux__
+  auto opts = sheap::segment_options{};
+  opts.memfd = true;
+  opts.populate = true;
+  auto seg = sheap::segment::create(name, MAX_MEMORY, config, opts);
+  REQUIRE(seg.fd() >= 0);
+  REQUIRE(seg.heap().alloc(0, 64) != nullptr);
+#endif
+}
+
+#ifdef __linux__
+// Run by SheapSegment in a process of its own; does nothing otherwise. Every
+// thread slot allocates from bins the creator never used.
+TEST_CASE("SheapSegmentChild") {
+  auto name = std::getenv("SHEAP_TEST_SEGMENT");
+  if (name == nullptr)
+    return;
+
+  auto seg = sheap::segment::open(name);
+  REQUIRE_FALSE(seg.heap().needs_recovery());
+  REQUIRE(*seg.heap().find<int>("answer") == 42);
+
+  for (int i = 1; i <= 4096; i += 37) {
+    auto ptr = seg.heap().alloc(i % 4, i);
+    REQUIRE(ptr != nullptr);
+    clobber(ptr, i);
+    seg.heap().free(ptr);
+    seg.heap().flush_thread_cache(i % 4);
+  }
+}
+#endif
+#endif
+
+TEST_CASE("SheapReopen") {
+  constexpr auto MAX_MEMORY = 32'000'000;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{4};
+
+  {
+    auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+    REQUIRE_FALSE(sheap.needs_recovery());
+
+    // Users that are attached or closed need no recovery.
+    auto other = sheap::Sheap{mem.get(), MAX_MEMORY, sheap::open_existing};
+    REQUIRE_FALSE(other.needs_recovery());
+    other.close();
+    REQUIRE_FALSE(sheap.needs_recovery());
+    sheap.close();
+  }
+
+  REQUIRE_THROWS_AS(sheap::Sheap(mem->data() + 64, MAX_MEMORY - 64,
+                                 sheap::open_existing),
+                    std::invalid_argument);
+
+#if __has_include(<sys/mman.h>)
+  auto shared = mmap(nullptr, MAX_MEMORY, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  REQUIRE(shared != MAP_FAILED);
+  std::unordered_set<void *> live;
+
+  // A process dies without close(), with objects live in every thread
+  // cache. They are linked through their first word, from the root.
+  auto pid = fork();
+  if (pid == 0) {
+    auto sheap = sheap::Sheap{shared, MAX_MEMORY, config};
+    void *head = nullptr;
+
+    for (int i = 0; i < 1000; i++) {
+      auto ptr = sheap.alloc(i % 4, 16 + i % 512);
+      if (ptr == nullptr)
+        _exit(1);
+      clobber(ptr, 16);
+
+      if (i % 3 == 0) {
+        sheap.free(ptr);
+      } else {
+        *static_cast<void **>(ptr) = head;
+        head = ptr;
+      }
+    }
+
+    sheap.set_root(head);
+    _exit(0);
+  }
+
+  int status = 0;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE((WIFEXITED(status) && WEXITSTATUS(status) == 0));
+
+  auto sheap = sheap::Sheap{shared, MAX_MEMORY, sheap::open_existing};
+  REQUIRE(sheap.needs_recovery());
+  sheap.recover();
+  REQUIRE_FALSE(sheap.needs_recovery());
+
+  for (auto ptr = sheap.get_root(); ptr; ptr = *static_cast<void **>(ptr))
+    REQUIRE(live.insert(ptr).second);
+  REQUIRE(live.size() == 666);
+
+  for (int i = 0; i < 2000; i++) {
+    auto ptr = sheap.alloc(i % 4, 16 + i % 512);
+    REQUIRE(ptr != nullptr);
+    REQUIRE(live.count(ptr) == 0);
+    clobber(ptr, 16);
+    live.insert(ptr);
+  }
+
+  for (auto ptr : live)
+    sheap.free(ptr);
+
+  auto root = sheap.get_root();
+  sheap.close();
+
+  auto reopened = sheap::Sheap{shared, MAX_MEMORY, sheap::open_existing};
+  REQUIRE_FALSE(reopened.needs_recovery());
+  REQUIRE(reopened.get_root() == root);
+  reopened.close();
+
+  // Reopened by another process while this one is still attached, whose
+  // thread caches were never used or flushed by the first one.
+  auto first = sheap::Sheap{shared, MAX_MEMORY, config};
+  first.free(first.alloc(0, 64));
+  first.flush_thread_cache(0);
+
+  pid = fork();
+  if (pid == 0) {
+    auto second = sheap::Sheap{shared, MAX_MEMORY, sheap::open_existing};
+    auto ok = !second.needs_recovery();
+
+    for (int i = 0; ok && i < 1000; i++) {
+      auto ptr = second.alloc(i % 4, 16 + i % 512);
+      if ((ok = ptr != nullptr)) {
+        clobber(ptr, 16);
+        second.free(ptr);
+      }
+    }
+    second.close();
+    _exit(ok ? 0 : 1);
+  }
+
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE((WIFEXITED(status) && WEXITSTATUS(status) == 0));
+  first.close();
+
+  auto third = sheap::Sheap{shared, MAX_MEMORY, sheap::open_existing};
+  REQUIRE_FALSE(third.needs_recovery());
+  REQUIRE(third.alloc(1, 64) != nullptr);
+  third.close();
+  munmap(shared, MAX_MEMORY);
+#endif
+}
+
+#if __has_include(<sys/mman.h>)
+TEST_CASE("SheapFork") {
+  constexpr auto MAX_MEMORY = 32'000'000;
+  constexpr auto NUM_THREADS = 3;
+  auto mem = mem_alloc<MAX_MEMORY>();
+  auto config = sheap::config{NUM_THREADS + 1};
+  auto sheap = sheap::Sheap{mem.get(), MAX_MEMORY, config};
+  std::atomic<bool> done = false;
+  std::vector<std::thread> threads;
+
+  // Other threads allocate and free, through the C++ runtime too, while the
+  // heap is forked. A child that inherits a lock held by one of them hangs.
+  for (int tid = 0; tid < NUM_THREADS; tid++) {
+    threads.emplace_back([&, tid] {
+      std::vector<void *> ptrs;
+      while (!done) {
+        for (int i = 0; i < 500; i++)
+          ptrs.push_back(sheap.alloc(tid, 8 + i * 7 % 2000));
+        for (auto ptr : ptrs)
+          sheap.free(ptr);
+        ptrs.clear();
+        sheap.collect_garbage(tid);
+        std::vector<std::string> strs;
+        for (int i = 0; i < 500; i++)
+          strs.emplace_back(16 + i * 13 % 3000, 'x');
+      }
+    });
+  }
+
+  for (int i = 0; i < 50; i++) {
+    sheap.lock_for_fork();
+    auto pid = fork();
+    sheap.unlock_after_fork();
+
+    if (pid == 0) {
+      alarm(10);
+#ifndef ASAN_ENABLED
+      // ASan's own malloc may not be used in the child.
+      std::vector<std::string> strs;
+      for (int j = 0; j < 500; j++)
+        strs.emplace_back(16 + j * 13 % 3000, 'x');
+#endif
+      std::array<void *, 1000> ptrs;
+      for (int j = 0; j < 1000; j++)
+        ptrs[j] = sheap.alloc(NUM_THREADS, 8 + j * 7 % 2000);
+      for (auto ptr : ptrs)
+        sheap.free(NUM_THREADS, ptr);
+      sheap.collect_garbage_full();
+      _exit(std::count(ptrs.begin(), ptrs.end(), nullptr) == 0 ? 0 : 1);
+    }
+
+    int status = 0;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE((WIFEXITED(status) && WEXITSTATUS(status) == 0));
+  }
+
+  done = true;
+  for (auto &t : threads)
+    t.join();
+}
+#endif
+
 TEST_CASE("SheapRandom") {
   enum { ALLOC, FREE, GC };
 